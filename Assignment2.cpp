@@ -3,6 +3,13 @@
 #include <fstream>
 #include <vector>
 #include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #define DEG2RAD(p) p*(6.28/360)
@@ -14,20 +21,290 @@
 #include <FTGL/ftgl.h>
 #include <GLFW/glfw3.h>
 #include <SOIL/SOIL.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "assetpack.h"
 
 
 using namespace std;
 
+/* GPU objects are created and released through the resource manager. Each one has a reference count and
+ * the bytes it owns, so lifetimes are explicit and live memory can be reported per type. */
+enum ResourceType { RESOURCE_VERTEX_ARRAY, RESOURCE_BUFFER, RESOURCE_TEXTURE, RESOURCE_PROGRAM, RESOURCE_FRAMEBUFFER, RESOURCE_TYPES };
+const char* resourceTypeNames[RESOURCE_TYPES] = { "vertex arrays", "buffers", "textures", "programs", "framebuffers" };
+
+/* What an object's memory is spent on - live bytes are also kept per category and held to the memory budget */
+enum MemoryCategory { MEMORY_MESHES, MEMORY_TEXTURES, MEMORY_FONTS, MEMORY_TARGETS, MEMORY_STREAMING, MEMORY_SHADERS, MEMORY_CATEGORIES };
+const char* memoryCategoryNames[MEMORY_CATEGORIES] = { "meshes", "textures", "fonts", "render targets", "streaming", "shaders" };
+
+/* Slot and generation of a tracked object - a handle to a released object no longer resolves.
+ * The zero handle is the null handle. */
+template <int Type>
+struct ResourceHandle {
+	int slot;       // 1-based index into Resources.slots
+	int generation;
+};
+typedef ResourceHandle<RESOURCE_VERTEX_ARRAY> VertexArrayHandle;
+typedef ResourceHandle<RESOURCE_BUFFER> BufferHandle;
+typedef ResourceHandle<RESOURCE_TEXTURE> TextureHandle;
+typedef ResourceHandle<RESOURCE_PROGRAM> ProgramHandle;
+typedef ResourceHandle<RESOURCE_FRAMEBUFFER> FramebufferHandle;
+
+struct GLResource {
+	int type;
+	int category;      // MemoryCategory
+	GLuint name;       // 0 while the slot is free
+	int generation;
+	int refs;
+	size_t bytes;      // storage the application asked for
+	std::string label;
+};
+
+struct GLResourceManager {
+	vector<GLResource> slots;
+	vector<int> freeSlots;
+	int live[RESOURCE_TYPES];
+	size_t liveBytes[RESOURCE_TYPES];
+	size_t peakBytes[RESOURCE_TYPES];
+	size_t categoryBytes[MEMORY_CATEGORIES];
+	size_t categoryPeak[MEMORY_CATEGORIES];
+	size_t totalBytes;
+	size_t totalPeak;
+	size_t budget;     // warn when totalBytes goes over it, 0 for no budget
+	bool overBudget;
+} Resources;
+
+/* Print the live bytes of every category */
+void printMemoryCategories ()
+{
+	for (int c=0; c<MEMORY_CATEGORIES; c++)
+		cout << (c ? ", " : " ") << memoryCategoryNames[c] << " " << Resources.categoryBytes[c]/1024 << " KB";
+}
+
+/* Move 'resource' by 'delta' bytes in its type, its category and the total, then hold the total to the budget.
+ * Crossing the budget warns once, going back under it re-arms the warning. */
+void accountResourceBytes (const GLResource& resource, size_t delta)
+{
+	Resources.liveBytes[resource.type] += delta;
+	Resources.peakBytes[resource.type] = max(Resources.peakBytes[resource.type], Resources.liveBytes[resource.type]);
+	Resources.categoryBytes[resource.category] += delta;
+	Resources.categoryPeak[resource.category] = max(Resources.categoryPeak[resource.category], Resources.categoryBytes[resource.category]);
+	Resources.totalBytes += delta;
+	Resources.totalPeak = max(Resources.totalPeak, Resources.totalBytes);
+
+	bool over = Resources.budget && Resources.totalBytes > Resources.budget;
+	if (over && !Resources.overBudget) {
+		cout << "MEMORY BUDGET: " << Resources.totalBytes/1024 << " KB is over the " << Resources.budget/1024 << " KB budget after '" << resource.label << "' -";
+		printMemoryCategories();
+		cout << endl;
+	}
+	Resources.overBudget = over;
+}
+
+/* The tracked object a handle refers to, NULL for the null handle or a released object */
+template <int Type>
+GLResource* findResource (ResourceHandle<Type> handle)
+{
+	if (handle.slot <= 0 || handle.slot > (int)Resources.slots.size())
+		return NULL;
+	GLResource& resource = Resources.slots[handle.slot-1];
+	if (resource.name == 0 || resource.generation != handle.generation || resource.type != Type)
+		return NULL;
+	return &resource;
+}
+
+/* Whether two handles name the same object - a recycled slot comes back with a new generation */
+template <int Type>
+bool sameResource (ResourceHandle<Type> a, ResourceHandle<Type> b)
+{
+	return a.slot == b.slot && a.generation == b.generation;
+}
+
+/* Take ownership of a GL object, the handle returned holds the first reference */
+template <int Type>
+ResourceHandle<Type> trackResource (GLuint name, size_t bytes, int category, const std::string& label)
+{
+	int slot;
+	if (!Resources.freeSlots.empty()) {
+		slot = Resources.freeSlots.back();
+		Resources.freeSlots.pop_back();
+	}
+	else {
+		Resources.slots.push_back(GLResource());
+		Resources.slots.back().generation = 0;
+		slot = Resources.slots.size();
+	}
+	GLResource& resource = Resources.slots[slot-1];
+	resource.type = Type;
+	resource.category = category;
+	resource.name = name;
+	resource.generation++;
+	resource.refs = 1;
+	resource.bytes = bytes;
+	resource.label = label;
+	Resources.live[Type]++;
+	accountResourceBytes(resource, bytes);
+
+	ResourceHandle<Type> handle = { slot, resource.generation };
+	return handle;
+}
+
+template <int Type>
+GLuint resourceName (ResourceHandle<Type> handle)
+{
+	GLResource* resource = findResource(handle);
+	return resource ? resource->name : 0;
+}
+
+/* Add a reference, returns the handle so it can be stored in one go */
+template <int Type>
+ResourceHandle<Type> retainResource (ResourceHandle<Type> handle)
+{
+	GLResource* resource = findResource(handle);
+	if (resource)
+		resource->refs++;
+	return handle;
+}
+
+/* Record a change in the storage of a tracked object, e.g. a buffer that was grown */
+template <int Type>
+void setResourceBytes (ResourceHandle<Type> handle, size_t bytes)
+{
+	GLResource* resource = findResource(handle);
+	if (!resource)
+		return;
+	accountResourceBytes(*resource, bytes - resource->bytes);
+	resource->bytes = bytes;
+}
+
+/* Drop a reference and clear the handle - the GL object is deleted with the last one */
+template <int Type>
+void releaseResource (ResourceHandle<Type>& handle)
+{
+	GLResource* resource = findResource(handle);
+	handle.slot = 0;
+	if (!resource || --resource->refs > 0)
+		return;
+
+	switch (Type) {
+		case RESOURCE_VERTEX_ARRAY:
+			glDeleteVertexArrays(1, &resource->name);
+			break;
+		case RESOURCE_BUFFER:
+			glDeleteBuffers(1, &resource->name);
+			break;
+		case RESOURCE_TEXTURE:
+			glDeleteTextures(1, &resource->name);
+			break;
+		case RESOURCE_PROGRAM:
+			glDeleteProgram(resource->name);
+			break;
+		case RESOURCE_FRAMEBUFFER:
+			glDeleteFramebuffers(1, &resource->name);
+			break;
+	}
+	Resources.live[Type]--;
+	accountResourceBytes(*resource, -resource->bytes);
+	resource->name = 0;
+	resource->label.clear();
+	Resources.freeSlots.push_back(&*resource - &Resources.slots[0] + 1);
+}
+
+VertexArrayHandle createVertexArray (int category, const std::string& label)
+{
+	GLuint name;
+	glGenVertexArrays(1, &name);
+	return trackResource<RESOURCE_VERTEX_ARRAY>(name, 0, category, label);
+}
+
+/* Generate a buffer, bind it to 'target' and give it 'bytes' of storage */
+BufferHandle createBuffer (GLenum target, GLsizeiptr bytes, const void* data, GLenum usage, int category, const std::string& label)
+{
+	GLuint name;
+	glGenBuffers(1, &name);
+	glBindBuffer(target, name);
+	glBufferData(target, bytes, data, usage);
+	return trackResource<RESOURCE_BUFFER>(name, bytes, category, label);
+}
+
+/* Texture storage is specified later, by whoever uploads it */
+TextureHandle createTextureName (int category, const std::string& label)
+{
+	GLuint name;
+	glGenTextures(1, &name);
+	return trackResource<RESOURCE_TEXTURE>(name, 0, category, label);
+}
+
+FramebufferHandle createFramebuffer (int category, const std::string& label)
+{
+	GLuint name;
+	glGenFramebuffers(1, &name);
+	return trackResource<RESOURCE_FRAMEBUFFER>(name, 0, category, label);
+}
+
+/* Direct state access variants - the objects exist as soon as they are created, so they can be set up without binding */
+VertexArrayHandle createVertexArrayDirect (int category, const std::string& label)
+{
+	GLuint name;
+	glCreateVertexArrays(1, &name);
+	return trackResource<RESOURCE_VERTEX_ARRAY>(name, 0, category, label);
+}
+
+/* Immutable storage, filled from 'data' */
+BufferHandle createBufferDirect (GLsizeiptr bytes, const void* data, int category, const std::string& label)
+{
+	GLuint name;
+	glCreateBuffers(1, &name);
+	glNamedBufferStorage(name, bytes, data, 0);
+	return trackResource<RESOURCE_BUFFER>(name, bytes, category, label);
+}
+
+/* Print live objects and bytes per type and per category, listing the objects still alive when 'leaks' is set */
+void reportResources (const char* when, bool leaks=false)
+{
+	cout << "RESOURCES [" << when << "]:";
+	for (int t=0; t<RESOURCE_TYPES; t++)
+		cout << (t ? ", " : " ") << Resources.live[t] << " " << resourceTypeNames[t] << " " << Resources.liveBytes[t]/1024 << " KB (peak " << Resources.peakBytes[t]/1024 << " KB)";
+	cout << endl;
+	cout << "GPU MEMORY [" << when << "]: " << Resources.totalBytes/1024 << " KB (peak " << Resources.totalPeak/1024 << " KB";
+	if (Resources.budget)
+		cout << ", budget " << Resources.budget/1024 << " KB";
+	cout << ") -";
+	printMemoryCategories();
+	cout << endl;
+	if (!leaks)
+		return;
+	for (size_t s=0; s<Resources.slots.size(); s++)
+		if (Resources.slots[s].name)
+			cout << "LEAKED: " << resourceTypeNames[Resources.slots[s].type] << " '" << Resources.slots[s].label << "', " << Resources.slots[s].refs << " references, " << Resources.slots[s].bytes << " bytes" << endl;
+}
+
+/* Names are cached for drawing - the handles hold the references */
 struct VAO {
 	GLuint VertexArrayID;
 	GLuint VertexBuffer;
 	GLuint ColorBuffer;
 	GLuint TextureBuffer;
-	GLuint TextureID;
+	VertexArrayHandle VertexArray;
+	BufferHandle Vertices;
+	BufferHandle Colors;
+	BufferHandle Texcoords;
+	int Layer;       // material layer the texcoords sample, textured objects only
 
 	GLenum PrimitiveMode;
 	GLenum FillMode;
 	int NumVertices;
+
+	// Copy of the geometry in the shared mesh arena, drawn as indexed triangles
+	GLuint ArenaFirstIndex;
+	GLuint ArenaIndexCount;
+	GLint ArenaBaseVertex;
 };
 typedef struct VAO VAO;
 
@@ -35,46 +312,479 @@ struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID;
-	GLuint TexMatrixID;
 } Matrices;
 
+/* Per-frame data shared by all programs through the std140 "FrameData" uniform block */
+/* Layout must match the block declared in the vertex shaders */
+struct GLFrameData {
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::mat4 VP;
+	glm::mat4 hudVP; // fixed camera for the 2D text overlay
+	glm::vec4 time;  // x = seconds since glfwInit
+};
+
+#define FRAME_DATA_BINDING 0
+
+struct GLFrameBuffer {
+	GLFrameData data;
+	GLintptr Offset; // where this frame's copy lives in the upload ring
+} FrameData;
+
 struct FTGLFont {
 	FTFont* font;
-	GLuint fontMatrixID;
+	GLuint fontOffsetID;
 	GLuint fontColorID;
 } GL3Font;
 
-GLuint programID, fontProgramID, textureProgramID;
+GLuint programID, fontProgramID, textureProgramID, sceneProgramID;
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+/* How drawScene submits the board */
+enum ScenePath {
+	SCENE_PATH_INSTANCED, // one glDrawArraysInstanced per mesh (GL 3.3)
+	SCENE_PATH_INDIRECT   // glMultiDrawElementsIndirect over the mesh arena (GL 4.3 / ARB_multi_draw_indirect)
+};
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+/* How the HUD text is drawn */
+enum TextRenderer {
+	TEXT_ATLAS, // quads over a FreeType glyph atlas, every string in one draw
+	TEXT_FTGL   // FTExtrudeFont::Render, tessellated outlines per string
+};
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
+/* Command line switches */
+struct GameOptions {
+	int scenePath = SCENE_PATH_INDIRECT; // requested ScenePath, falls back to instanced when unsupported
+	bool benchScene = false;             // print scene submission timings
+	bool stats = false;                  // print per-second rendering statistics
+	bool occlusion = true;               // cull pillars and enemies hidden behind the pillar field
+	bool compressTextures = false;       // store textures as S3TC/DXT1 when the driver supports it
+	bool watchShaders = false;           // recompile programs when their GLSL files change on disk
+	const char* traceFile = NULL;        // Chrome trace JSON output, NULL when not tracing
+	int textRenderer = TEXT_ATLAS;       // requested TextRenderer, falls back to FTGL when the atlas cannot be built
+	bool benchText = false;              // time both text renderers at startup
+	bool idle = true;                    // block on events instead of drawing every frame when nothing is happening
+	const char* recordFile = NULL;       // .y4m file or PPM sequence prefix to record frames to, NULL when not recording
+	float sceneScale = 0;                // fixed scene resolution as a fraction of the window, 0 to scale it to the frame budget
+	double frameBudget = 1000.0/60;      // ms of GPU time the dynamic scene resolution aims for
+	bool multiView = false;              // start with the picture-in-picture camera views on
+	bool minimap = true;                 // top-down board map in the HUD corner
+	bool cullFaces = true;               // skip the back faces of the scene meshes
+	bool depthPrepass = false;           // lay down the scene's depth before shading it
+	bool overdraw = false;               // count the fragments shaded per pixel and report them once a second
+	bool heatmap = false;                // start with the fragment count heatmap in place of the picture
+	bool uberShader = true;              // draw the whole scene with one program instead of the colored and textured pair
+	bool profilerOverlay = false;        // start with the frame cost and GPU memory overlay on
+	double memoryBudget = 64;            // MB of tracked GPU memory before warning, 0 for no budget
+	bool dsa = true;                     // set up the meshes and the upload ring with direct state access when the driver has it
+} Options;
+
+/* Enemy circle level of detail */
+#define ENEMY_LOD_LEVELS 5
+#define ENEMY_LOD_FULL_SEGMENTS 360
+#define ENEMY_LOD_PIXELS_PER_SEGMENT 4.0f // target edge length on screen
+#define ENEMY_LOD_HYSTERESIS 1.25f        // how far below a level's threshold before dropping to it
+
+/* Counters gathered while drawing, reported once a second with --stats */
+struct GameStats {
+	long long enemyTriangles;      // enemy triangles actually submitted
+	long long enemyTrianglesSaved; // against drawing every enemy at full detail
+	int enemyLevels[ENEMY_LOD_LEVELS]; // enemies drawn at each LOD level
+	int pillarsCulled;             // pillars hidden behind the pillar field
+	int hudRebuilds;               // frames the HUD text had to be regenerated
+	int minimapRefreshes;          // frames the minimap was rendered again
+	int enemiesCulled;
+	int frames;
+	double lastReport;
+} Stats;
+
+/* Startup cost per phase, printed once initGL is done */
+struct StartupTimes {
+	double decode;  // from starting the workers until every image is decoded
+	double wait;    // part of 'decode' the context thread spent blocked on the workers
+	double upload;
+	double shaders;
+	double meshes;
+	double total;
+	int textures;
+	int threads;
+	int cacheHits;          // textures uploaded straight from the texture cache
+	int uploadsSkipped;     // material sources never uploaded, the material array came from the texture cache
+	size_t textureBytes;    // size of every uploaded mip level
+} Startup;
+
+/* Idle rendering - after the game ends or while the window is in the background the loop blocks on events
+ * and redraws only on input or every IDLE_TICK_SECONDS */
+#define IDLE_TICK_SECONDS 0.25
+#define ACTIVE_FRAME_RATE 60 // what the loop would have drawn with vsync, for the savings estimate
+
+struct IdleState {
+	bool focused;
+	bool iconified;
+	bool wake;         // input arrived since the last frame
+	bool active;       // currently in idle mode
+	double since;      // when idle mode was entered
+	double lastDraw;
+	double checked;    // last time the loop looked at the idle state
+	int frames;        // drawn while idle
+	double cpuMs;      // average cost of a frame drawn outside idle mode
+	double gpuMs;
+} Idle = { true, false, false, false, 0, 0, 0, 0, 0, 0 };
+
+int screenWidth = 1600, screenHeight = 800; // framebuffer size in pixels
+
+/* Chrome trace output (--trace file.json): complete events for the startup phases and every frame,
+ * viewable in chrome://tracing or Perfetto. Events are buffered and written out once per frame */
+struct TraceEvent {
+	std::string name;
+	char phase;      // 'X' complete, 'i' instant, 'M' thread name
+	double start;    // microseconds since tracing started
+	double duration;
+	int thread;
+};
+
+struct TraceLog {
+	FILE* file; // NULL unless tracing
+	std::mutex lock;
+	vector<TraceEvent> pending;
+	bool first;
+} Trace;
+
+thread_local int traceThread = 0; // 0 is the context thread, texture workers number themselves from 1
+
+double traceNow ()
+{
+	static std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+}
+
+void addTraceEvent (const std::string& name, char phase, double start, double duration)
+{
+	if (!Trace.file)
+		return;
+	TraceEvent event = { name, phase, start, duration, traceThread };
+	std::lock_guard<std::mutex> guard(Trace.lock);
+	Trace.pending.push_back(event);
+}
+
+/* Record the span from 'start' (a traceNow value) until now */
+void traceEnd (const char* name, double start)
+{
+	if (Trace.file)
+		addTraceEvent(name, 'X', start, traceNow() - start);
+}
+
+/* Mark a point in time, e.g. the first presented frame */
+void traceInstant (const char* name)
+{
+	addTraceEvent(name, 'i', traceNow(), 0);
+}
+
+void traceThreadName (const std::string& name)
+{
+	addTraceEvent(name, 'M', 0, 0);
+}
+
+/* Records the enclosing block as one complete event, does nothing when not tracing */
+struct TraceScope {
+	const char* name;
+	const char* detail; // appended to the name, e.g. the file being loaded
+	double start;
+
+	TraceScope (const char* name, const char* detail = NULL) : name(name), detail(detail), start(Trace.file ? traceNow() : 0) {}
+	~TraceScope ()
 	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
+		if (Trace.file)
+			addTraceEvent(detail ? std::string(name) + " " + detail : std::string(name), 'X', start, traceNow() - start);
+	}
+};
+
+void flushTrace ()
+{
+	if (!Trace.file)
+		return;
+	std::lock_guard<std::mutex> guard(Trace.lock);
+	for (size_t i=0; i<Trace.pending.size(); i++) {
+		const TraceEvent& event = Trace.pending[i];
+		fprintf(Trace.file, "%s\n", Trace.first ? "" : ",");
+		Trace.first = false;
+		if (event.phase == 'M')
+			fprintf(Trace.file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", event.thread, event.name.c_str());
+		else if (event.phase == 'i')
+			fprintf(Trace.file, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", event.name.c_str(), event.thread, event.start);
+		else
+			fprintf(Trace.file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", event.name.c_str(), event.thread, event.start, event.duration);
+	}
+	Trace.pending.clear();
+	fflush(Trace.file);
+}
+
+void closeTrace ()
+{
+	if (!Trace.file)
+		return;
+	flushTrace();
+	fprintf(Trace.file, "\n]\n");
+	fclose(Trace.file);
+	Trace.file = NULL;
+}
+
+/* Start tracing into 'path' - the file is completed at exit */
+void openTrace (const char* path)
+{
+	Trace.file = fopen(path, "w");
+	if (!Trace.file) {
+		cout << "Could not open trace file: " << path << endl;
+		return;
+	}
+	fprintf(Trace.file, "[");
+	Trace.first = true;
+	traceNow();
+	traceThreadName("main");
+	atexit(closeTrace);
+}
+
+int scenePath = SCENE_PATH_INSTANCED; // path actually in use
+bool multiView = false;                // picture-in-picture views of the other cameras, toggled with V
+bool minimap = true;                   // board map in the HUD corner, toggled with M
+bool cullFaces = true;                 // back-face culling of the scene, toggled with C
+bool depthPrepass = false;             // depth-only pass before the scene is shaded, toggled with P
+bool heatmap = false;                  // fragments per pixel as heat colours, toggled with H
+bool uberShader = true;                // scene.vert/frag for every mesh, toggled with G
+bool profilerOverlay = false;          // frame cost and GPU memory in the bottom left corner, toggled with O
+bool dsaPath = false;                  // meshes built with direct state access, chosen once at startup
+
+/* The indirect path needs multi draw indirect plus base instance for the streamed offsets */
+bool indirectSupported ()
+{
+	return GLAD_GL_ARB_multi_draw_indirect && GLAD_GL_ARB_base_instance;
+}
+
+/* GL 4.5 direct state access, plus immutable storage for the persistent ring and base instance to pick offsets from it */
+bool dsaSupported ()
+{
+	return GLAD_GL_ARB_direct_state_access && GLAD_GL_ARB_buffer_storage && GLAD_GL_ARB_base_instance;
+}
+
+/* Textures, shaders and the font are read from one mmap'd pack (see packassets.cpp), or from the loose files without it */
+#define ASSET_PACK_PATH "assets.pak"
+
+struct AssetView {
+	const unsigned char* data;
+	size_t size;
+};
+
+struct AssetPack {
+	const unsigned char* base; // NULL when no pack is mapped
+	size_t size;
+	const AssetPackEntry* entries;
+	uint32_t count;
+} Assets;
+
+/* Map the asset pack for the lifetime of the game, returns false when it is missing or malformed */
+bool openAssetPack (const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(AssetPackHeader)) {
+		close(fd);
+		return false;
+	}
+	void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return false;
+
+	const AssetPackHeader* header = (const AssetPackHeader*) base;
+	const AssetPackEntry* entries = (const AssetPackEntry*) (header + 1);
+	bool valid = header->magic == ASSET_PACK_MAGIC && header->version == ASSET_PACK_VERSION &&
+	             sizeof(AssetPackHeader) + header->count*sizeof(AssetPackEntry) <= (size_t)st.st_size;
+	for (uint32_t i=0; valid && i<header->count; i++)
+		valid = entries[i].offset <= (uint64_t)st.st_size && entries[i].size <= (uint64_t)st.st_size - entries[i].offset &&
+		        memchr(entries[i].name, 0, ASSET_PACK_NAME_LENGTH) != NULL;
+	if (!valid) {
+		cout << "Ignoring malformed asset pack: " << path << endl;
+		munmap(base, st.st_size);
+		return false;
+	}
+
+	Assets.base = (const unsigned char*) base;
+	Assets.size = st.st_size;
+	Assets.entries = entries;
+	Assets.count = header->count;
+	return true;
+}
+
+/* Look 'name' up in the mapped pack - the view stays valid for the whole run */
+bool findAsset (const char* name, AssetView& view)
+{
+	for (uint32_t i=0; Assets.base && i<Assets.count; i++) {
+		if (!strcmp(Assets.entries[i].name, name)) {
+			view.data = Assets.base + Assets.entries[i].offset;
+			view.size = Assets.entries[i].size;
+			return true;
+		}
+	}
+	return false;
+}
+
+vector<std::string> changedAssets; // loose files edited since startup, newer than their packed copy
+
+/* Get the bytes of an asset from the pack, or read the loose file into 'storage' when it is not packed (or was edited) */
+bool loadAsset (const char* name, AssetView& view, vector<unsigned char>& storage)
+{
+	bool changed = false;
+	for (size_t i=0; i<changedAssets.size() && !changed; i++)
+		changed = changedAssets[i] == name;
+	if (!changed && findAsset(name, view))
+		return true;
+	std::ifstream file(name, std::ios::in | std::ios::binary);
+	if (!file.is_open())
+		return false;
+	storage.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	view.data = storage.empty() ? NULL : &storage[0];
+	view.size = storage.size();
+	return true;
+}
+
+/* 64 bit FNV-1a, pass a previous result as 'hash' to continue it */
+uint64_t hashBytes (const unsigned char* data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+	for (size_t i=0; i<size; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* Program binary cache: linked programs are saved with glGetProgramBinary and reloaded with glProgramBinary.
+ * Files are keyed by the hash of both sources and the driver strings, since binaries only load on the driver that made them */
+#define SHADER_CACHE_DIR "shadercache"
+#define SHADER_CACHE_MAGIC 0x48435350 // "PSCH" on disk
+#define SHADER_CACHE_VERSION 1
+
+struct ShaderCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t binaryFormat;
+	uint32_t length; // binary of 'length' bytes follows
+};
+
+int programBinaryHits = 0;
+
+/* Binaries need GL 4.1 or ARB_get_program_binary, and a driver that offers at least one format */
+bool programBinarySupported ()
+{
+	if (!GLAD_GL_ARB_get_program_binary)
+		return false;
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+uint64_t programCacheKey (const std::string& vertexCode, const std::string& fragmentCode)
+{
+	uint64_t key = hashBytes((const unsigned char*) vertexCode.c_str(), vertexCode.size() + 1);
+	key = hashBytes((const unsigned char*) fragmentCode.c_str(), fragmentCode.size() + 1, key);
+	const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for (int i=0; i<3; i++) {
+		const char* value = (const char*) glGetString(strings[i]);
+		if (value)
+			key = hashBytes((const unsigned char*) value, strlen(value) + 1, key);
+	}
+	return key;
+}
+
+std::string programCachePath (uint64_t key)
+{
+	char name[32];
+	sprintf(name, "%016llx.bin", (unsigned long long) key);
+	return std::string(SHADER_CACHE_DIR) + "/" + name;
+}
+
+/* Create a program from its cached binary, returns 0 when there is none or the driver rejects it */
+GLuint loadProgramBinary (uint64_t key)
+{
+	std::ifstream file(programCachePath(key).c_str(), std::ios::in | std::ios::binary);
+	if (!file.is_open())
+		return 0;
+	vector<char> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (contents.size() < sizeof(ShaderCacheHeader))
+		return 0;
+	const ShaderCacheHeader* header = (const ShaderCacheHeader*) &contents[0];
+	if (header->magic != SHADER_CACHE_MAGIC || header->version != SHADER_CACHE_VERSION ||
+	    header->key != key || header->length != contents.size() - sizeof(ShaderCacheHeader))
+		return 0;
+
+	GLuint ProgramID = glCreateProgram();
+	glProgramBinary(ProgramID, header->binaryFormat, header + 1, header->length);
+	GLint Result = GL_FALSE;
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if (Result != GL_TRUE) {
+		// A driver update invalidates binaries even when the strings match - relink from source
+		glDeleteProgram(ProgramID);
+		return 0;
 	}
+	return ProgramID;
+}
+
+void saveProgramBinary (GLuint ProgramID, uint64_t key)
+{
+	GLint length = 0;
+	glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+	vector<char> binary(length);
+	GLenum binaryFormat;
+	glGetProgramBinary(ProgramID, length, &length, &binaryFormat, &binary[0]);
+	ShaderCacheHeader header = { SHADER_CACHE_MAGIC, SHADER_CACHE_VERSION, key, binaryFormat, (uint32_t)length };
+
+	mkdir(SHADER_CACHE_DIR, 0755);
+	std::string path = programCachePath(key);
+	std::ofstream file(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	file.write((const char*) &header, sizeof(header));
+	file.write(&binary[0], length);
+	if (!file.good()) {
+		file.close();
+		remove(path.c_str());
+		cout << "Could not write program cache: " << path << endl;
+	}
+}
+
+/* Function to load Shaders - Use it as it is */
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+	TraceScope trace("LoadShaders", vertex_file_path);
+	double start = glfwGetTime();
+
+	// Read the shader code from the asset pack (or the loose files)
+	AssetView asset;
+	vector<unsigned char> storage;
+	std::string VertexShaderCode;
+	if (loadAsset(vertex_file_path, asset, storage))
+		VertexShaderCode.assign((const char*) asset.data, asset.size);
 
-	// Read the Fragment Shader code from the file
 	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
+	if (loadAsset(fragment_file_path, asset, storage))
+		FragmentShaderCode.assign((const char*) asset.data, asset.size);
+
+	// Skip compiling and linking when this driver already linked the same sources
+	bool useBinary = programBinarySupported();
+	uint64_t key = useBinary ? programCacheKey(VertexShaderCode, FragmentShaderCode) : 0;
+	if (useBinary) {
+		GLuint CachedProgramID = loadProgramBinary(key);
+		if (CachedProgramID) {
+			programBinaryHits++;
+			Startup.shaders += (glfwGetTime() - start) * 1000;
+			return CachedProgramID;
+		}
 	}
 
+	// Create the shaders
+	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
 
@@ -109,6 +819,8 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	GLuint ProgramID = glCreateProgram();
 	glAttachShader(ProgramID, VertexShaderID);
 	glAttachShader(ProgramID, FragmentShaderID);
+	if (useBinary)
+		glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(ProgramID);
 
 	// Check the program
@@ -121,210 +833,1778 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	glDeleteShader(VertexShaderID);
 	glDeleteShader(FragmentShaderID);
 
-	return ProgramID;
+	if (useBinary && Result == GL_TRUE)
+		saveProgramBinary(ProgramID, key);
+
+	Startup.shaders += (glfwGetTime() - start) * 1000;
+	return ProgramID;
+}
+
+/* Every program is linked once - callers naming the same pair of shader files share it.
+ * Each program keeps the variables holding it and the setup it needs (block bindings, uniform locations),
+ * so a reload can swap a new program in for all of them */
+struct ShaderProgram {
+	std::string vertexPath;
+	std::string fragmentPath;
+	GLuint ProgramID;
+	ProgramHandle Handle;
+	vector<GLuint*> users;
+	void (*setup)(GLuint program);
+};
+
+vector<ShaderProgram> ShaderRegistry;
+int shaderGeneration = 0; // bumped whenever a reload swaps a program in
+
+/* Hand a linked program to the resource manager - its size is only known through the binary interface */
+ProgramHandle trackProgram (GLuint ProgramID, const std::string& label)
+{
+	GLint length = 0;
+	if (GLAD_GL_ARB_get_program_binary)
+		glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+	return trackResource<RESOURCE_PROGRAM>(ProgramID, length, MEMORY_SHADERS, label);
+}
+
+GLuint getProgram (const char* vertex_file_path, const char* fragment_file_path, GLuint& user, void (*setup)(GLuint program))
+{
+	for (size_t i=0; i<ShaderRegistry.size(); i++) {
+		if (ShaderRegistry[i].vertexPath == vertex_file_path && ShaderRegistry[i].fragmentPath == fragment_file_path) {
+			ShaderRegistry[i].users.push_back(&user);
+			return user = ShaderRegistry[i].ProgramID;
+		}
+	}
+	ShaderProgram program;
+	program.vertexPath = vertex_file_path;
+	program.fragmentPath = fragment_file_path;
+	program.ProgramID = LoadShaders(vertex_file_path, fragment_file_path);
+	program.Handle = trackProgram(program.ProgramID, program.vertexPath + " + " + program.fragmentPath);
+	program.users.push_back(&user);
+	program.setup = setup;
+	ShaderRegistry.push_back(program);
+	if (setup)
+		setup(program.ProgramID);
+	return user = program.ProgramID;
+}
+
+/* Shader hot reload: a watcher thread reads inotify events for the working directory and queues the names
+ * of registered shader files that were written. GL work stays on the context thread, which picks the queue
+ * up between frames in reloadChangedShaders. */
+struct ShaderWatcher {
+	int fd;
+	std::thread thread;
+	std::mutex lock;
+	vector<std::string> changed; // guarded by 'lock'
+	std::atomic<bool> pending;
+} Watcher;
+
+bool isShaderFile (const char* name)
+{
+	for (size_t i=0; i<ShaderRegistry.size(); i++)
+		if (ShaderRegistry[i].vertexPath == name || ShaderRegistry[i].fragmentPath == name)
+			return true;
+	return false;
+}
+
+void shaderWatcherThread ()
+{
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	for (;;) {
+		ssize_t length = read(Watcher.fd, buffer, sizeof(buffer));
+		if (length <= 0)
+			return;
+		for (char* p = buffer; p < buffer + length; ) {
+			const struct inotify_event* event = (const struct inotify_event*) p;
+			p += sizeof(struct inotify_event) + event->len;
+			// The registry is only appended to during initGL, before the thread starts
+			if (event->len == 0 || !isShaderFile(event->name))
+				continue;
+			std::lock_guard<std::mutex> guard(Watcher.lock);
+			Watcher.changed.push_back(event->name);
+			Watcher.pending = true;
+		}
+	}
+}
+
+/* Start watching the shader files, call once every program is registered */
+void watchShaders ()
+{
+	Watcher.pending = false;
+	Watcher.fd = inotify_init();
+	// Editors either rewrite the file in place or rename a temporary over it
+	if (Watcher.fd < 0 || inotify_add_watch(Watcher.fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		cout << "Shader hot reload unavailable: inotify failed" << endl;
+		return;
+	}
+	Watcher.thread = std::thread(shaderWatcherThread);
+	Watcher.thread.detach();
+	cout << "SHADER RELOAD: watching " << ShaderRegistry.size() << " programs" << endl;
+}
+
+/* Relink every program using a changed file. A program that fails to link is discarded and the old one kept */
+void reloadChangedShaders ()
+{
+	if (!Watcher.pending)
+		return;
+	vector<std::string> changed;
+	{
+		std::lock_guard<std::mutex> guard(Watcher.lock);
+		changed.swap(Watcher.changed);
+		Watcher.pending = false;
+	}
+	for (size_t c=0; c<changed.size(); c++) {
+		bool known = false;
+		for (size_t i=0; i<changedAssets.size() && !known; i++)
+			known = changedAssets[i] == changed[c];
+		if (!known)
+			changedAssets.push_back(changed[c]);
+	}
+
+	for (size_t i=0; i<ShaderRegistry.size(); i++) {
+		ShaderProgram& program = ShaderRegistry[i];
+		bool affected = false;
+		for (size_t c=0; c<changed.size(); c++)
+			affected = affected || program.vertexPath == changed[c] || program.fragmentPath == changed[c];
+		if (!affected)
+			continue;
+
+		double start = glfwGetTime();
+		GLuint ProgramID = LoadShaders(program.vertexPath.c_str(), program.fragmentPath.c_str());
+		GLint Result = GL_FALSE;
+		glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+		if (Result != GL_TRUE) {
+			glDeleteProgram(ProgramID);
+			cout << "SHADER RELOAD: " << program.vertexPath << " + " << program.fragmentPath << " failed, keeping the old program" << endl;
+			continue;
+		}
+		if (program.setup)
+			program.setup(ProgramID);
+		releaseResource(program.Handle);
+		program.Handle = trackProgram(ProgramID, program.vertexPath + " + " + program.fragmentPath);
+		program.ProgramID = ProgramID;
+		for (size_t u=0; u<program.users.size(); u++)
+			*program.users[u] = ProgramID;
+		shaderGeneration++;
+		cout << "SHADER RELOAD: " << program.vertexPath << " + " << program.fragmentPath << " swapped in (" << (glfwGetTime() - start) * 1000 << " ms)" << endl;
+	}
+}
+
+/* Delete every program and clear the variables holding them. The entries stay, the watcher thread reads them */
+void destroyPrograms ()
+{
+	for (size_t i=0; i<ShaderRegistry.size(); i++) {
+		releaseResource(ShaderRegistry[i].Handle);
+		ShaderRegistry[i].ProgramID = 0;
+		for (size_t u=0; u<ShaderRegistry[i].users.size(); u++)
+			*ShaderRegistry[i].users[u] = 0;
+	}
+}
+
+static void error_callback(int error, const char* description)
+{
+	fprintf(stderr, "Error: %s\n", description);
+}
+
+/* Leave the main loop, which releases every GPU resource before terminating */
+void quit(GLFWwindow *window)
+{
+	glfwSetWindowShouldClose(window, GL_TRUE);
+}
+
+glm::vec3 getRGBfromHue (int hue)
+{
+	float intp;
+	float fracp = modff(hue/60.0, &intp);
+	float x = 1.0 - abs((float)((int)intp%2)+fracp-1.0);
+
+	if (hue < 60)
+		return glm::vec3(1,x,0);
+	else if (hue < 120)
+		return glm::vec3(x,1,0);
+	else if (hue < 180)
+		return glm::vec3(0,1,x);
+	else if (hue < 240)
+		return glm::vec3(0,x,1);
+	else if (hue < 300)
+		return glm::vec3(x,0,1);
+	else
+		return glm::vec3(1,0,x);
+}
+
+/* Streaming upload ring for per-frame data (instance offsets, uniform blocks)
+ * With ARB_buffer_storage the buffer is mapped once, persistently, and split into
+ * UPLOAD_RING_FRAMES regions; a fence per region keeps the CPU from overwriting
+ * data the GPU is still reading. Without it (plain GL 3.3) the buffer is orphaned
+ * at the start of every frame and written through unsynchronized ranged maps. */
+#define UPLOAD_RING_FRAMES 3
+#define UPLOAD_RING_REGION_SIZE (4*1024*1024)
+
+struct GLUploadRing {
+	GLuint Buffer;
+	BufferHandle Handle;
+	GLsizeiptr RegionSize;
+	int Region;               // region being written this frame
+	GLsizeiptr Head;          // bytes already used in that region
+	GLsync Fences[UPLOAD_RING_FRAMES];
+	unsigned char* Mapped;    // persistent mapping, NULL on the orphaning path
+	bool Persistent;
+	GLint UniformAlignment;
+	int Stalls;               // frames that had to wait on a fence
+} UploadRing;
+
+void createUploadRing ()
+{
+	TraceScope trace("createUploadRing");
+	UploadRing.RegionSize = UPLOAD_RING_REGION_SIZE;
+	UploadRing.Region = 0;
+	UploadRing.Head = 0;
+	UploadRing.Stalls = 0;
+	UploadRing.Mapped = NULL;
+	for (int i=0; i<UPLOAD_RING_FRAMES; i++)
+		UploadRing.Fences[i] = 0;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &UploadRing.UniformAlignment);
+
+	UploadRing.Persistent = GLAD_GL_ARB_buffer_storage != 0;
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	if (dsaPath) {
+		// Created, given storage and mapped without touching the binding points
+		glCreateBuffers(1, &UploadRing.Buffer);
+		glNamedBufferStorage(UploadRing.Buffer, UPLOAD_RING_FRAMES*UploadRing.RegionSize, NULL, flags);
+		UploadRing.Mapped = (unsigned char*) glMapNamedBufferRange(UploadRing.Buffer, 0, UPLOAD_RING_FRAMES*UploadRing.RegionSize, flags);
+	}
+	else {
+		glGenBuffers(1, &UploadRing.Buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, UploadRing.Buffer);
+		if (UploadRing.Persistent) {
+			glBufferStorage(GL_ARRAY_BUFFER, UPLOAD_RING_FRAMES*UploadRing.RegionSize, NULL, flags);
+			UploadRing.Mapped = (unsigned char*) glMapBufferRange(GL_ARRAY_BUFFER, 0, UPLOAD_RING_FRAMES*UploadRing.RegionSize, flags);
+		}
+		else {
+			// Orphaning path only ever uses one region, re-specified every frame
+			glBufferData(GL_ARRAY_BUFFER, UploadRing.RegionSize, NULL, GL_STREAM_DRAW);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	UploadRing.Handle = trackResource<RESOURCE_BUFFER>(UploadRing.Buffer, (UploadRing.Persistent ? UPLOAD_RING_FRAMES : 1)*UploadRing.RegionSize, MEMORY_STREAMING, "upload ring");
+	cout << "UPLOAD RING: " << (UploadRing.Persistent ? "persistent mapped, triple buffered" : "orphaning fallback") << endl;
+}
+
+/* Deleting the buffer also drops the persistent mapping */
+void destroyUploadRing ()
+{
+	for (int i=0; i<UPLOAD_RING_FRAMES; i++) {
+		if (UploadRing.Fences[i])
+			glDeleteSync(UploadRing.Fences[i]);
+		UploadRing.Fences[i] = 0;
+	}
+	releaseResource(UploadRing.Handle);
+	UploadRing.Buffer = 0;
+	UploadRing.Mapped = NULL;
+}
+
+/* Move to the next region, waiting only if the GPU has not finished with it yet */
+void beginUploadFrame ()
+{
+	UploadRing.Head = 0;
+	if (!UploadRing.Persistent) {
+		glBindBuffer(GL_ARRAY_BUFFER, UploadRing.Buffer);
+		glBufferData(GL_ARRAY_BUFFER, UploadRing.RegionSize, NULL, GL_STREAM_DRAW); // orphan last frame's storage
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return;
+	}
+
+	UploadRing.Region = (UploadRing.Region + 1) % UPLOAD_RING_FRAMES;
+	GLsync fence = UploadRing.Fences[UploadRing.Region];
+	if (fence) {
+		GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (status == GL_TIMEOUT_EXPIRED) {
+			UploadRing.Stalls++;
+			while (status == GL_TIMEOUT_EXPIRED)
+				status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); // 1ms steps
+		}
+		glDeleteSync(fence);
+		UploadRing.Fences[UploadRing.Region] = 0;
+	}
+}
+
+/* Fence the region written this frame - call after the frame's last draw */
+void endUploadFrame ()
+{
+	if (UploadRing.Persistent)
+		UploadRing.Fences[UploadRing.Region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/* Copy 'size' bytes into the current region and return their offset in UploadRing.Buffer, or -1 if the region is full */
+GLintptr uploadRingWrite (const void* data, GLsizeiptr size, GLsizeiptr alignment)
+{
+	GLsizeiptr head = (UploadRing.Head + alignment - 1) / alignment * alignment;
+	if (head + size > UploadRing.RegionSize) {
+		static bool warned = false;
+		if (!warned)
+			cout << "UPLOAD RING: region of " << UploadRing.RegionSize << " bytes is full, dropping uploads" << endl;
+		warned = true;
+		return -1;
+	}
+	UploadRing.Head = head + size;
+
+	if (UploadRing.Persistent) {
+		GLintptr offset = UploadRing.Region*UploadRing.RegionSize + head;
+		memcpy(UploadRing.Mapped + offset, data, size);
+		return offset;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, UploadRing.Buffer);
+	void* dst = glMapBufferRange(GL_ARRAY_BUFFER, head, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	memcpy(dst, data, size);
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+	return head;
+}
+
+/* Point attribute 3 (per-instance offset: xyz = translation, w = rotation about +Y) of the bound VAO at the ring */
+void bindInstanceOffsets (GLintptr offset)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, UploadRing.Buffer);
+	glEnableVertexAttribArray(3);
+	glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 0, (void*)offset);
+	glVertexAttribDivisor(3, 1);
+}
+
+/* Direct state access: attribute 'attrib' of 'vertexArray' reads 'size' floats at 'offset' in each vertex of 'binding' */
+void setVertexArrayAttrib (GLuint vertexArray, GLuint attrib, GLuint binding, GLint size, GLuint offset)
+{
+	glVertexArrayAttribFormat(vertexArray, attrib, size, GL_FLOAT, GL_FALSE, offset);
+	glVertexArrayAttribBinding(vertexArray, attrib, binding);
+	glEnableVertexArrayAttrib(vertexArray, attrib);
+}
+
+/* Direct state access: attribute 3 reads the per-instance offsets from the start of the ring through 'binding'.
+ * Draws select their offsets with baseInstance, so the VAO never has to be re-pointed */
+void attachInstanceOffsets (GLuint vertexArray, GLuint binding)
+{
+	glVertexArrayVertexBuffer(vertexArray, binding, UploadRing.Buffer, 0, sizeof(glm::vec4));
+	glVertexArrayBindingDivisor(vertexArray, binding, 1);
+	setVertexArrayAttrib(vertexArray, 3, binding, 4, 0);
+}
+
+/* Material layer of vertex colored meshes, scene.frag takes the vertex color for any negative layer */
+#define MATERIAL_VERTEX_COLOR -1
+
+/* Shared vertex/index arena - every mesh is also copied here so the whole scene can be
+ * submitted with glMultiDrawElementsIndirect from a single VAO */
+struct ArenaVertex {
+	GLfloat position[3];
+	GLfloat color[3];
+	GLfloat texcoord[3]; // s, t, material layer
+};
+
+struct GLMeshArena {
+	GLuint VertexArrayID;
+	GLuint VertexBuffer;
+	GLuint IndexBuffer;
+	VertexArrayHandle VertexArray;
+	BufferHandle Vertices;
+	BufferHandle Indices;
+	vector<ArenaVertex> vertices;
+	vector<GLuint> indices;
+} Arena;
+
+/* Append a mesh to the arena as a triangle list (fans are split), missing colors or texcoords are zero */
+void addToArena (struct VAO* vao, GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, const GLfloat* texture_buffer_data)
+{
+	vao->ArenaBaseVertex = Arena.vertices.size();
+	vao->ArenaFirstIndex = Arena.indices.size();
+
+	for (int i=0; i<numVertices; i++) {
+		ArenaVertex v;
+		memset(&v, 0, sizeof(v));
+		memcpy(v.position, vertex_buffer_data + 3*i, 3*sizeof(GLfloat));
+		if (color_buffer_data)
+			memcpy(v.color, color_buffer_data + 3*i, 3*sizeof(GLfloat));
+		if (texture_buffer_data)
+			memcpy(v.texcoord, texture_buffer_data + 3*i, 3*sizeof(GLfloat));
+		else
+			v.texcoord[2] = MATERIAL_VERTEX_COLOR;
+		Arena.vertices.push_back(v);
+	}
+
+	if (primitive_mode == GL_TRIANGLE_FAN) {
+		for (int i=1; i+1<numVertices; i++) {
+			Arena.indices.push_back(0);
+			Arena.indices.push_back(i);
+			Arena.indices.push_back(i+1);
+		}
+	}
+	else {
+		for (int i=0; i<numVertices; i++)
+			Arena.indices.push_back(i);
+	}
+	vao->ArenaIndexCount = Arena.indices.size() - vao->ArenaFirstIndex;
+}
+
+/* Upload the arena once every mesh has been created */
+void buildMeshArena ()
+{
+	TraceScope trace("buildMeshArena");
+	if (dsaPath) {
+		// Vertices on binding 0, the ring's instance offsets on binding 1
+		Arena.VertexArray = createVertexArrayDirect(MEMORY_MESHES, "mesh arena");
+		Arena.VertexArrayID = resourceName(Arena.VertexArray);
+		Arena.Vertices = createBufferDirect(Arena.vertices.size()*sizeof(ArenaVertex), &Arena.vertices[0], MEMORY_MESHES, "mesh arena vertices");
+		Arena.VertexBuffer = resourceName(Arena.Vertices);
+		Arena.Indices = createBufferDirect(Arena.indices.size()*sizeof(GLuint), &Arena.indices[0], MEMORY_MESHES, "mesh arena indices");
+		Arena.IndexBuffer = resourceName(Arena.Indices);
+
+		glVertexArrayVertexBuffer(Arena.VertexArrayID, 0, Arena.VertexBuffer, 0, sizeof(ArenaVertex));
+		glVertexArrayElementBuffer(Arena.VertexArrayID, Arena.IndexBuffer);
+		setVertexArrayAttrib(Arena.VertexArrayID, 0, 0, 3, offsetof(ArenaVertex, position));
+		setVertexArrayAttrib(Arena.VertexArrayID, 1, 0, 3, offsetof(ArenaVertex, color));
+		setVertexArrayAttrib(Arena.VertexArrayID, 2, 0, 3, offsetof(ArenaVertex, texcoord));
+		attachInstanceOffsets(Arena.VertexArrayID, 1);
+	}
+	else {
+		Arena.VertexArray = createVertexArray(MEMORY_MESHES, "mesh arena");
+		Arena.VertexArrayID = resourceName(Arena.VertexArray);
+
+		glBindVertexArray(Arena.VertexArrayID);
+		Arena.Vertices = createBuffer(GL_ARRAY_BUFFER, Arena.vertices.size()*sizeof(ArenaVertex), &Arena.vertices[0], GL_STATIC_DRAW, MEMORY_MESHES, "mesh arena vertices");
+		Arena.VertexBuffer = resourceName(Arena.Vertices);
+		Arena.Indices = createBuffer(GL_ELEMENT_ARRAY_BUFFER, Arena.indices.size()*sizeof(GLuint), &Arena.indices[0], GL_STATIC_DRAW, MEMORY_MESHES, "mesh arena indices");
+		Arena.IndexBuffer = resourceName(Arena.Indices);
+
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(ArenaVertex), (void*)offsetof(ArenaVertex, position));
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(ArenaVertex), (void*)offsetof(ArenaVertex, color));
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(ArenaVertex), (void*)offsetof(ArenaVertex, texcoord));
+		glBindVertexArray(0);
+	}
+
+	cout << "MESH ARENA: " << Arena.vertices.size() << " vertices, " << Arena.indices.size() << " indices" << endl;
+}
+
+void destroyMeshArena ()
+{
+	releaseResource(Arena.VertexArray);
+	releaseResource(Arena.Vertices);
+	releaseResource(Arena.Indices);
+	Arena.vertices.clear();
+	Arena.indices.clear();
+}
+
+/* Materials: every game texture is copied into a layer of one GL_TEXTURE_2D_ARRAY once it is uploaded, and
+ * textured meshes carry their layer as the third texture coordinate - so the scene binds a single texture
+ * per frame however many materials are on screen. Layers are handed out as meshes ask for them, before
+ * the uploads. loadMaterialArray uploads the finished array from the texture cache, so the sources are never
+ * uploaded; on a miss buildMaterialArray copies the uploaded sources into it. */
+#define MATERIAL_CACHE_NAME "materials.array" // texture cache entry of the finished array
+
+struct MaterialArray {
+	GLuint TextureID;
+	TextureHandle Texture;
+	vector<TextureHandle> layers; // source texture of each layer, held until the array is built
+	uint64_t key;                 // hash of the images behind the layers, 0 when one did not load
+	int width;                    // of every layer, the largest source in each direction
+	int height;
+} Materials;
+
+int materialLayer (TextureHandle texture)
+{
+	for (size_t l=0; l<Materials.layers.size(); l++)
+		if (sameResource(Materials.layers[l], texture))
+			return l;
+	Materials.layers.push_back(retainResource(texture));
+	return Materials.layers.size() - 1;
+}
+
+bool isMaterialSource (TextureHandle texture)
+{
+	for (size_t l=0; l<Materials.layers.size(); l++)
+		if (sameResource(Materials.layers[l], texture))
+			return true;
+	return false;
+}
+
+/* Direct state access version of the VAO setup below: the buffers get immutable storage and the VAO records them,
+ * their formats and the instance offsets without anything being bound. 'attrib' is 1 (colors) or 2 (texcoords). */
+void createDirectMesh (struct VAO* vao, const std::string& label, const GLfloat* vertex_buffer_data, GLuint attrib, const GLfloat* attrib_buffer_data, const char* attribName)
+{
+	GLsizeiptr bytes = 3*vao->NumVertices*sizeof(GLfloat);
+	vao->VertexArray = createVertexArrayDirect(MEMORY_MESHES, label);
+	vao->VertexArrayID = resourceName(vao->VertexArray);
+	vao->Vertices = createBufferDirect(bytes, vertex_buffer_data, MEMORY_MESHES, label + " vertices");
+	vao->VertexBuffer = resourceName(vao->Vertices);
+	BufferHandle& attribBuffer = attrib == 1 ? vao->Colors : vao->Texcoords;
+	attribBuffer = createBufferDirect(bytes, attrib_buffer_data, MEMORY_MESHES, label + " " + attribName);
+	(attrib == 1 ? vao->ColorBuffer : vao->TextureBuffer) = resourceName(attribBuffer);
+
+	// Each attribute on the binding of the same index, the instance offsets on binding 3
+	glVertexArrayVertexBuffer(vao->VertexArrayID, 0, vao->VertexBuffer, 0, 3*sizeof(GLfloat));
+	setVertexArrayAttrib(vao->VertexArrayID, 0, 0, 3, 0);
+	glVertexArrayVertexBuffer(vao->VertexArrayID, attrib, resourceName(attribBuffer), 0, 3*sizeof(GLfloat));
+	setVertexArrayAttrib(vao->VertexArrayID, attrib, attrib, 3, 0);
+	attachInstanceOffsets(vao->VertexArrayID, 3);
+}
+
+/* Generate VAO, VBOs and return VAO handle */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+{
+	struct VAO* vao = new struct VAO();
+	vao->PrimitiveMode = primitive_mode;
+	vao->NumVertices = numVertices;
+	vao->FillMode = fill_mode;
+
+	if (dsaPath) {
+		createDirectMesh(vao, "mesh", vertex_buffer_data, 1, color_buffer_data, "colors");
+		addToArena(vao, primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, NULL);
+		return vao;
+	}
+
+	// Create Vertex Array Object
+	// Should be done after CreateWindow and before any other GL calls
+	vao->VertexArray = createVertexArray(MEMORY_MESHES, "mesh"); // VAO
+	vao->VertexArrayID = resourceName(vao->VertexArray);
+
+	glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
+	vao->Vertices = createBuffer(GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW, MEMORY_MESHES, "mesh vertices"); // Copy the vertices into VBO
+	vao->VertexBuffer = resourceName(vao->Vertices);
+	glVertexAttribPointer(
+			0,                  // attribute 0. Vertices
+			3,                  // size (x,y,z)
+			GL_FLOAT,           // type
+			GL_FALSE,           // normalized?
+			0,                  // stride
+			(void*)0            // array buffer offset
+			);
+
+	vao->Colors = createBuffer(GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW, MEMORY_MESHES, "mesh colors");  // Copy the vertex colors
+	vao->ColorBuffer = resourceName(vao->Colors);
+	glVertexAttribPointer(
+			1,                  // attribute 1. Color
+			3,                  // size (r,g,b)
+			GL_FLOAT,           // type
+			GL_FALSE,           // normalized?
+			0,                  // stride
+			(void*)0            // array buffer offset
+			);
+
+	addToArena(vao, primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, NULL);
+
+	return vao;
+}
+
+/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+{
+	vector<GLfloat> color_buffer_data(3*numVertices);
+	for (int i=0; i<numVertices; i++) {
+		color_buffer_data [3*i] = red;
+		color_buffer_data [3*i + 1] = green;
+		color_buffer_data [3*i + 2] = blue;
+	}
+
+	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, &color_buffer_data[0], fill_mode);
+}
+
+/* The texture becomes a material layer, sampled through the third texture coordinate */
+struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, TextureHandle texture, GLenum fill_mode=GL_FILL)
+{
+	struct VAO* vao = new struct VAO();
+	vao->PrimitiveMode = primitive_mode;
+	vao->NumVertices = numVertices;
+	vao->FillMode = fill_mode;
+	vao->Layer = materialLayer(texture);
+
+	vector<GLfloat> texcoords(3*numVertices);
+	for (int i=0; i<numVertices; i++) {
+		texcoords[3*i] = texture_buffer_data[2*i];
+		texcoords[3*i + 1] = texture_buffer_data[2*i + 1];
+		texcoords[3*i + 2] = vao->Layer;
+	}
+
+	if (dsaPath) {
+		createDirectMesh(vao, "textured mesh", vertex_buffer_data, 2, &texcoords[0], "texcoords");
+		addToArena(vao, primitive_mode, numVertices, vertex_buffer_data, NULL, &texcoords[0]);
+		return vao;
+	}
+
+	// Create Vertex Array Object
+	// Should be done after CreateWindow and before any other GL calls
+	vao->VertexArray = createVertexArray(MEMORY_MESHES, "textured mesh"); // VAO
+	vao->VertexArrayID = resourceName(vao->VertexArray);
+
+	glBindVertexArray (vao->VertexArrayID); // Bind the VAO
+	vao->Vertices = createBuffer(GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW, MEMORY_MESHES, "textured mesh vertices"); // Copy the vertices into VBO
+	vao->VertexBuffer = resourceName(vao->Vertices);
+	glVertexAttribPointer(
+			0,                  // attribute 0. Vertices
+			3,                  // size (x,y,z)
+			GL_FLOAT,           // type
+			GL_FALSE,           // normalized?
+			0,                  // stride
+			(void*)0            // array buffer offset
+			);
+
+	vao->Texcoords = createBuffer(GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), &texcoords[0], GL_STATIC_DRAW, MEMORY_MESHES, "textured mesh texcoords");  // Copy the vertex colors
+	vao->TextureBuffer = resourceName(vao->Texcoords);
+	glVertexAttribPointer(
+			2,                  // attribute 2. Textures
+			3,                  // size (s,t,layer)
+			GL_FLOAT,           // type
+			GL_FALSE,           // normalized?
+			0,                  // stride
+			(void*)0            // array buffer offset
+			);
+
+	addToArena(vao, primitive_mode, numVertices, vertex_buffer_data, NULL, &texcoords[0]);
+
+	return vao;
+}
+
+/* Release the buffers of an object made by create3DObject or create3DTexturedObject */
+void destroy3DObject (struct VAO*& vao)
+{
+	if (!vao)
+		return;
+	releaseResource(vao->VertexArray);
+	releaseResource(vao->Vertices);
+	releaseResource(vao->Colors);
+	releaseResource(vao->Texcoords);
+	delete vao;
+	vao = NULL;
+}
+
+/* Render the VBOs handled by VAO, once for each of the 'instances' offsets at 'instanceOffset' in the upload ring */
+void draw3DObject (struct VAO* vao, GLintptr instanceOffset, GLsizei instances)
+{
+	// Change the Fill Mode for this object
+	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+
+	// Bind the VAO to use
+	glBindVertexArray (vao->VertexArrayID);
+
+	// A direct state access VAO already records its buffers, only the instance offsets are picked per draw
+	if (dsaPath) {
+		glDrawArraysInstancedBaseInstance(vao->PrimitiveMode, 0, vao->NumVertices, instances, instanceOffset / sizeof(glm::vec4));
+		return;
+	}
+
+	// Enable Vertex Attribute 0 - 3d Vertices
+	glEnableVertexAttribArray(0);
+	// Bind the VBO to use
+	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+
+	// Enable Vertex Attribute 1 - Color
+	glEnableVertexAttribArray(1);
+	// Bind the VBO to use
+	glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+
+	// Enable Vertex Attribute 3 - Instance offsets
+	bindInstanceOffsets(instanceOffset);
+
+	// Draw the geometry !
+	glDrawArraysInstanced(vao->PrimitiveMode, 0, vao->NumVertices, instances);
+}
+
+void draw3DTexturedObject (struct VAO* vao, GLintptr instanceOffset, GLsizei instances)
+{
+	// Change the Fill Mode for this object
+	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+
+	// Bind the VAO to use
+	glBindVertexArray (vao->VertexArrayID);
+
+	// A direct state access VAO already records its buffers, only the instance offsets are picked per draw
+	if (dsaPath) {
+		glDrawArraysInstancedBaseInstance(vao->PrimitiveMode, 0, vao->NumVertices, instances, instanceOffset / sizeof(glm::vec4));
+		return;
+	}
+
+	// Enable Vertex Attribute 0 - 3d Vertices
+	glEnableVertexAttribArray(0);
+	// Bind the VBO to use
+	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+
+	// The material array is bound once per frame by drawScene
+
+	// Enable Vertex Attribute 2 - Texture
+	glEnableVertexAttribArray(2);
+	// Bind the VBO to use
+	glBindBuffer(GL_ARRAY_BUFFER, vao->TextureBuffer);
+
+	// Enable Vertex Attribute 3 - Instance offsets
+	bindInstanceOffsets(instanceOffset);
+
+	// Draw the geometry !
+	glDrawArraysInstanced(vao->PrimitiveMode, 0, vao->NumVertices, instances);
+}
+
+/* GPU timer built from timestamp queries - results are read a few frames late so the CPU never waits.
+ * Timestamps (rather than GL_TIME_ELAPSED) let timers nest. */
+#define GPU_TIMER_LATENCY 4
+
+struct GLGpuTimer {
+	GLuint Queries[GPU_TIMER_LATENCY][2];
+	int Next;
+	int Pending;
+	double LastMs; // most recent result
+};
+
+void createGpuTimer (GLGpuTimer& timer)
+{
+	glGenQueries(2*GPU_TIMER_LATENCY, &timer.Queries[0][0]);
+	timer.Next = 0;
+	timer.Pending = 0;
+	timer.LastMs = 0;
+}
+
+void beginGpuTimer (GLGpuTimer& timer)
+{
+	glQueryCounter(timer.Queries[timer.Next][0], GL_TIMESTAMP);
+}
+
+/* Close the measurement and collect the oldest one if the GPU has finished it */
+void endGpuTimer (GLGpuTimer& timer)
+{
+	glQueryCounter(timer.Queries[timer.Next][1], GL_TIMESTAMP);
+	timer.Next = (timer.Next + 1) % GPU_TIMER_LATENCY;
+	if (timer.Pending < GPU_TIMER_LATENCY)
+		timer.Pending++;
+
+	if (timer.Pending == GPU_TIMER_LATENCY) {
+		// the slot about to be reused holds the oldest measurement
+		GLuint* oldest = timer.Queries[timer.Next];
+		GLint available = 0;
+		glGetQueryObjectiv(oldest[1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 start, end;
+			glGetQueryObjectui64v(oldest[0], GL_QUERY_RESULT, &start);
+			glGetQueryObjectui64v(oldest[1], GL_QUERY_RESULT, &end);
+			timer.LastMs = (end - start) / 1.0e6;
+		}
+	}
+}
+
+/* Offscreen colour + depth/stencil target, both textures so later passes can sample them */
+struct GLRenderTarget {
+	GLuint FramebufferID;
+	GLuint ColorTextureID;
+	FramebufferHandle Framebuffer;
+	TextureHandle Color;
+	TextureHandle Depth;
+	int width;
+	int height;
+};
+
+GLRenderTarget createRenderTarget (int width, int height, const std::string& label)
+{
+	GLRenderTarget target;
+	target.width = width;
+	target.height = height;
+
+	target.Color = createTextureName(MEMORY_TARGETS, label + " colour");
+	target.ColorTextureID = resourceName(target.Color);
+	glBindTexture(GL_TEXTURE_2D, target.ColorTextureID);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	setResourceBytes(target.Color, 4*width*height);
+
+	target.Depth = createTextureName(MEMORY_TARGETS, label + " depth");
+	glBindTexture(GL_TEXTURE_2D, resourceName(target.Depth));
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	setResourceBytes(target.Depth, 4*width*height);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	target.Framebuffer = createFramebuffer(MEMORY_TARGETS, label);
+	target.FramebufferID = resourceName(target.Framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, target.FramebufferID);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.ColorTextureID, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, resourceName(target.Depth), 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		cout << "Render target '" << label << "' is incomplete" << endl;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return target;
+}
+
+void destroyRenderTarget (GLRenderTarget& target)
+{
+	releaseResource(target.Framebuffer);
+	releaseResource(target.Color);
+	releaseResource(target.Depth);
+	target.FramebufferID = target.ColorTextureID = 0;
+	target.width = target.height = 0;
+}
+
+/* --record: every frame is read back into a ring of pixel buffer objects and only mapped once the fence
+ * behind it has signalled, RECORD_RING_SIZE frames later, so glReadPixels never waits for the GPU.
+ * A writer thread encodes the frames to a .y4m file (YUV 4:2:0) or to a numbered PPM sequence.
+ * The output is paced to ACTIVE_FRAME_RATE: a frame that stayed on screen longer (idle redraws, a missed vsync)
+ * is written again for every video frame it covered, and one replaced before the next video frame is skipped,
+ * so the file plays back in real time. */
+#define RECORD_RING_SIZE 3
+#define RECORD_QUEUE_FRAMES 16 // frames waiting for the writer before new ones are dropped
+
+struct RecordSlot {
+	BufferHandle Buffer;
+	GLuint BufferID;
+	GLsync Fence;    // 0 while the slot holds no frame
+	int repeats;     // video frames it covers, known once the next frame is captured - 0 skips it
+};
+
+struct RecordedFrame {
+	vector<unsigned char> rgba;
+	int repeats;
+};
+
+struct FrameRecorder {
+	bool active;
+	std::string path;
+	FILE* file;      // the .y4m output, NULL when writing a PPM sequence
+	int width;       // captured size, even so the chroma planes line up
+	int height;
+	RecordSlot ring[RECORD_RING_SIZE];
+	int next;        // slot the next frame is read into - also the oldest one still holding a frame
+	int last;        // slot of the latest captured frame, -1 before the first
+	double start;    // glfwGetTime() of video frame 0
+	int videoFrames; // video frames handed out to captured frames so far
+	std::thread writer;
+	std::mutex lock;
+	std::condition_variable wake;
+	vector<RecordedFrame> queue;           // RGBA frames for the writer, guarded by 'lock'
+	vector< vector<unsigned char> > spare; // buffers the writer is done with, guarded by 'lock'
+	bool done;                             // no more frames, guarded by 'lock'
+	int captured;
+	int written;     // video frames, counting repeats
+	int repeated;    // extra copies written to hold a frame on screen
+	int skipped;     // frames shown for less than one video frame
+	int dropped;     // queue full or the window changed size
+	int stalls;      // frames that had to wait for a readback
+	double cpuMs;    // total spent in captureFrame
+	double gpuMs;
+	GLGpuTimer timer;
+} Recorder;
+
+/* Write one RGBA frame (bottom row first, as GL reads it) 'repeats' times in the recording's format */
+void encodeFrame (const vector<unsigned char>& rgba, int index, int repeats)
+{
+	int w = Recorder.width, h = Recorder.height;
+	if (!Recorder.file) {
+		vector<unsigned char> row(3*w);
+		for (int r=0; r<repeats; r++) {
+			char name[512];
+			snprintf(name, sizeof(name), "%s%05d.ppm", Recorder.path.c_str(), index + r);
+			FILE* file = fopen(name, "wb");
+			if (!file)
+				return;
+			fprintf(file, "P6\n%d %d\n255\n", w, h);
+			for (int y=h-1; y>=0; y--) {
+				const unsigned char* src = &rgba[4*w*y];
+				for (int x=0; x<w; x++)
+					memcpy(&row[3*x], src + 4*x, 3);
+				fwrite(&row[0], 1, row.size(), file);
+			}
+			fclose(file);
+		}
+		return;
+	}
+
+	// Full range BT.601 (C420jpeg), chroma averaged over 2x2 blocks
+	vector<unsigned char> yuv(w*h + 2*(w/2)*(h/2));
+	unsigned char* Y = &yuv[0];
+	unsigned char* U = Y + w*h;
+	unsigned char* V = U + (w/2)*(h/2);
+	for (int y=0; y<h; y++) {
+		const unsigned char* src = &rgba[4*w*(h-1-y)];
+		for (int x=0; x<w; x++)
+			Y[y*w + x] = (unsigned char)(0.299f*src[4*x] + 0.587f*src[4*x+1] + 0.114f*src[4*x+2] + 0.5f);
+	}
+	for (int y=0; y<h/2; y++) {
+		const unsigned char* top = &rgba[4*w*(h-1-2*y)];
+		const unsigned char* bottom = &rgba[4*w*(h-2-2*y)];
+		for (int x=0; x<w/2; x++) {
+			float r = (top[8*x] + top[8*x+4] + bottom[8*x] + bottom[8*x+4]) / 4.0f;
+			float g = (top[8*x+1] + top[8*x+5] + bottom[8*x+1] + bottom[8*x+5]) / 4.0f;
+			float b = (top[8*x+2] + top[8*x+6] + bottom[8*x+2] + bottom[8*x+6]) / 4.0f;
+			U[y*(w/2) + x] = (unsigned char)(128 - 0.168736f*r - 0.331264f*g + 0.5f*b + 0.5f);
+			V[y*(w/2) + x] = (unsigned char)(128 + 0.5f*r - 0.418688f*g - 0.081312f*b + 0.5f);
+		}
+	}
+	for (int r=0; r<repeats; r++) {
+		fputs("FRAME\n", Recorder.file);
+		fwrite(&yuv[0], 1, yuv.size(), Recorder.file);
+	}
+}
+
+void recordWriterThread ()
+{
+	int index = 0;
+	for (;;) {
+		vector<unsigned char> frame;
+		int repeats;
+		{
+			std::unique_lock<std::mutex> guard(Recorder.lock);
+			Recorder.wake.wait(guard, [] { return !Recorder.queue.empty() || Recorder.done; });
+			if (Recorder.queue.empty())
+				return;
+			frame.swap(Recorder.queue.front().rgba);
+			repeats = Recorder.queue.front().repeats;
+			Recorder.queue.erase(Recorder.queue.begin());
+		}
+		encodeFrame(frame, index, repeats);
+		index += repeats;
+		std::lock_guard<std::mutex> guard(Recorder.lock);
+		Recorder.written += repeats;
+		Recorder.spare.push_back(vector<unsigned char>());
+		Recorder.spare.back().swap(frame);
+	}
+}
+
+/* Start recording at the current framebuffer size. 'path' ending in .y4m writes a video, anything else is
+ * the prefix of a PPM sequence */
+void startRecording (const char* path)
+{
+	Recorder.path = path;
+	Recorder.width = screenWidth & ~1;
+	Recorder.height = screenHeight & ~1;
+	Recorder.file = NULL;
+	if (Recorder.path.size() > 4 && Recorder.path.compare(Recorder.path.size()-4, 4, ".y4m") == 0) {
+		Recorder.file = fopen(path, "wb");
+		if (!Recorder.file) {
+			cout << "RECORD: cannot write " << path << endl;
+			return;
+		}
+		// paceRecording holds the file to this rate whatever the window presents at
+		fprintf(Recorder.file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", Recorder.width, Recorder.height, ACTIVE_FRAME_RATE);
+	}
+	for (int i=0; i<RECORD_RING_SIZE; i++) {
+		Recorder.ring[i].Buffer = createBuffer(GL_PIXEL_PACK_BUFFER, 4*Recorder.width*Recorder.height, NULL, GL_STREAM_READ, MEMORY_STREAMING, "record readback");
+		Recorder.ring[i].BufferID = resourceName(Recorder.ring[i].Buffer);
+		Recorder.ring[i].Fence = 0;
+		Recorder.ring[i].repeats = 0;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	createGpuTimer(Recorder.timer);
+	Recorder.next = 0;
+	Recorder.last = -1;
+	Recorder.start = glfwGetTime();
+	Recorder.videoFrames = 0;
+	Recorder.done = false;
+	Recorder.active = true;
+	Recorder.writer = std::thread(recordWriterThread);
+	cout << "RECORD: " << path << " at " << Recorder.width << "x" << Recorder.height << (Recorder.file ? ", y4m" : ", ppm sequence") << endl;
+}
+
+/* Map the frame held by 'slot' once the GPU has written it and hand it to the writer */
+void collectFrame (RecordSlot& slot)
+{
+	GLenum status = glClientWaitSync(slot.Fence, 0, 0);
+	if (status == GL_TIMEOUT_EXPIRED) {
+		Recorder.stalls++;
+		while (status == GL_TIMEOUT_EXPIRED)
+			status = glClientWaitSync(slot.Fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+	}
+	glDeleteSync(slot.Fence);
+	slot.Fence = 0;
+	if (slot.repeats == 0) {
+		Recorder.skipped++;
+		return;
+	}
+
+	size_t size = 4*Recorder.width*Recorder.height;
+	vector<unsigned char> frame;
+	{
+		std::lock_guard<std::mutex> guard(Recorder.lock);
+		if (Recorder.queue.size() >= RECORD_QUEUE_FRAMES) {
+			Recorder.dropped++;
+			return;
+		}
+		if (!Recorder.spare.empty()) {
+			frame.swap(Recorder.spare.back());
+			Recorder.spare.pop_back();
+		}
+	}
+	frame.resize(size);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.BufferID);
+	const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+	if (pixels)
+		memcpy(&frame[0], pixels, size);
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	std::lock_guard<std::mutex> guard(Recorder.lock);
+	Recorder.repeated += slot.repeats - 1;
+	Recorder.queue.push_back(RecordedFrame());
+	Recorder.queue.back().rgba.swap(frame);
+	Recorder.queue.back().repeats = slot.repeats;
+	Recorder.wake.notify_one();
+}
+
+/* Give the latest captured frame every video frame up to 'now' - it stayed on screen until then */
+void paceRecording (double now, int least)
+{
+	int videoFrames = (int) floor((now - Recorder.start) * ACTIVE_FRAME_RATE + 0.5);
+	if (Recorder.last >= 0) {
+		Recorder.ring[Recorder.last].repeats = max(videoFrames - Recorder.videoFrames, least);
+		Recorder.videoFrames += Recorder.ring[Recorder.last].repeats;
+	}
+}
+
+/* Queue a readback of the finished frame in the back buffer - call after the last draw, before the swap */
+void captureFrame ()
+{
+	if (!Recorder.active)
+		return;
+	TraceScope trace("captureFrame");
+	double start = glfwGetTime();
+	Recorder.captured++;
+	if ((screenWidth & ~1) != Recorder.width || (screenHeight & ~1) != Recorder.height) {
+		Recorder.dropped++;
+		return;
+	}
+
+	paceRecording(start, 0);
+
+	// The slot about to be reused holds the oldest frame, read RECORD_RING_SIZE frames ago
+	RecordSlot& slot = Recorder.ring[Recorder.next];
+	if (slot.Fence)
+		collectFrame(slot);
+
+	beginGpuTimer(Recorder.timer);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.BufferID);
+	glReadBuffer(GL_BACK);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, Recorder.width, Recorder.height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	slot.Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.repeats = 0;
+	endGpuTimer(Recorder.timer);
+	Recorder.last = Recorder.next;
+	Recorder.next = (Recorder.next + 1) % RECORD_RING_SIZE;
+
+	Recorder.gpuMs += Recorder.timer.LastMs;
+	Recorder.cpuMs += (glfwGetTime() - start) * 1000;
+}
+
+/* Collect the frames still in flight, wait for the writer and report what recording cost per frame */
+void finishRecording ()
+{
+	if (!Recorder.active)
+		return;
+	// The last frame stays in the file for at least one video frame
+	paceRecording(glfwGetTime(), 1);
+	for (int i=0; i<RECORD_RING_SIZE; i++) {
+		RecordSlot& slot = Recorder.ring[(Recorder.next + i) % RECORD_RING_SIZE];
+		if (slot.Fence)
+			collectFrame(slot);
+		releaseResource(slot.Buffer);
+	}
+	{
+		std::lock_guard<std::mutex> guard(Recorder.lock);
+		Recorder.done = true;
+		Recorder.wake.notify_one();
+	}
+	Recorder.writer.join();
+	if (Recorder.file)
+		fclose(Recorder.file);
+	Recorder.active = false;
+
+	int frames = max(Recorder.captured, 1);
+	cout << "RECORD: " << Recorder.written << " frames at " << ACTIVE_FRAME_RATE << " Hz written to " << Recorder.path << " (" << Recorder.repeated << " repeated, " << Recorder.skipped << " skipped), " << Recorder.dropped << " dropped, " << Recorder.stalls << " readback stalls, overhead " << Recorder.cpuMs/frames << " ms cpu " << Recorder.gpuMs/frames << " ms gpu per frame" << endl;
 }
 
-static void error_callback(int error, const char* description)
+/* An image decoded on a worker thread - only the GL upload happens on the context thread */
+struct TextureJob {
+	const char* filename;
+	GLuint TextureID;      // generated up front so meshes can reference it before the upload
+	TextureHandle Texture; // reference held for whoever started the job
+	int width;
+	int height;
+	unsigned char* pixels; // RGB8, NULL when decoding failed or the texture cache hit
+	uint64_t sourceHash;   // of the encoded image, keys the texture cache
+	vector<unsigned char> cache; // contents of a matching texture cache file, empty on a miss
+	std::string error;     // why decoding failed, read on the worker - SOIL_last_result() is shared by all threads
+	double finished;       // ms after the decode started that this job was done
+};
+
+/* Texture cache: the full mip chain of each texture as it was uploaded, in upload order.
+ * A file is reused only when it was built from the same encoded image in the same internal format,
+ * so later launches skip both decoding and glGenerateMipmap */
+#define TEXTURE_CACHE_DIR "texcache"
+#define TEXTURE_CACHE_MAGIC 0x48435854 // "TXCH" on disk
+#define TEXTURE_CACHE_VERSION 2
+
+struct TextureCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sourceHash;
+	uint32_t internalFormat; // GL_RGB or GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+	uint32_t levels;         // a TextureCacheLevel per level follows, then the level data back to back
+	uint32_t layers;         // 1, or the layers of a texture array, each the size of level 0
+	uint32_t reserved;
+};
+
+struct TextureCacheLevel {
+	uint32_t width;
+	uint32_t height;
+	uint32_t size;
+	uint32_t reserved;
+};
+
+GLenum textureFormat = GL_RGB; // internal format of every game texture, chosen in initGL
+
+std::string textureCachePath (const char* filename)
 {
-	fprintf(stderr, "Error: %s\n", description);
+	return std::string(TEXTURE_CACHE_DIR) + "/" + filename + ".cache";
 }
 
-void quit(GLFWwindow *window)
+/* Read the cache file of 'job' into job.cache, keeping it only when it matches the source, format and layer count */
+bool readTextureCache (TextureJob& job, uint32_t layers = 1)
 {
-	glfwDestroyWindow(window);
-	glfwTerminate();
-	exit(EXIT_SUCCESS);
+	std::ifstream file(textureCachePath(job.filename).c_str(), std::ios::in | std::ios::binary);
+	if (!file.is_open())
+		return false;
+	job.cache.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	if (job.cache.size() < sizeof(TextureCacheHeader)) {
+		job.cache.clear();
+		return false;
+	}
+
+	const TextureCacheHeader* header = (const TextureCacheHeader*) &job.cache[0];
+	size_t expected = sizeof(TextureCacheHeader);
+	bool valid = header->magic == TEXTURE_CACHE_MAGIC && header->version == TEXTURE_CACHE_VERSION && header->sourceHash == job.sourceHash &&
+	             header->internalFormat == textureFormat && header->levels > 0 && header->levels <= 32 && header->layers == layers;
+	if (valid) {
+		expected += header->levels*sizeof(TextureCacheLevel);
+		const TextureCacheLevel* levels = (const TextureCacheLevel*) (header + 1);
+		for (uint32_t l=0; l<header->levels && expected <= job.cache.size(); l++)
+			expected += levels[l].size;
+		valid = expected == job.cache.size();
+	}
+	if (!valid)
+		job.cache.clear();
+	return valid;
 }
 
-glm::vec3 getRGBfromHue (int hue)
+/* Upload every level of a cached chain to the bound texture - only for a job.cache readTextureCache kept */
+void uploadCachedTexture (TextureJob& job)
 {
-	float intp;
-	float fracp = modff(hue/60.0, &intp);
-	float x = 1.0 - abs((float)((int)intp%2)+fracp-1.0);
+	const TextureCacheHeader* header = (const TextureCacheHeader*) &job.cache[0];
+	const TextureCacheLevel* levels = (const TextureCacheLevel*) (header + 1);
+	const unsigned char* data = (const unsigned char*) (levels + header->levels);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (uint32_t l=0; l<header->levels; l++) {
+		if (header->internalFormat == GL_RGB)
+			glTexImage2D(GL_TEXTURE_2D, l, GL_RGB, levels[l].width, levels[l].height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+		else
+			glCompressedTexImage2D(GL_TEXTURE_2D, l, header->internalFormat, levels[l].width, levels[l].height, 0, levels[l].size, data);
+		data += levels[l].size;
+		Startup.textureBytes += levels[l].size;
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header->levels - 1);
+	job.cache.clear();
+	Startup.cacheHits++;
+}
 
-	if (hue < 60)
-		return glm::vec3(1,x,0);
-	else if (hue < 120)
-		return glm::vec3(x,1,0);
-	else if (hue < 180)
-		return glm::vec3(0,1,x);
-	else if (hue < 240)
-		return glm::vec3(0,x,1);
-	else if (hue < 300)
-		return glm::vec3(x,0,1);
-	else
-		return glm::vec3(1,0,x);
+/* Store a mip chain in textureFormat as the cache entry of 'filename', valid while its source hashes to 'sourceHash' */
+void writeTextureCacheFile (const char* filename, uint64_t sourceHash, uint32_t layers, vector<TextureCacheLevel>& levels, const vector< vector<unsigned char> >& data)
+{
+	int levelCount = levels.size();
+	TextureCacheHeader header = { TEXTURE_CACHE_MAGIC, TEXTURE_CACHE_VERSION, sourceHash, (uint32_t)textureFormat, (uint32_t)levelCount, layers, 0 };
+	for (int l=0; l<levelCount; l++)
+		levels[l].size = data[l].size();
+
+	mkdir(TEXTURE_CACHE_DIR, 0755);
+	std::string path = textureCachePath(filename);
+	std::ofstream file(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	file.write((const char*) &header, sizeof(header));
+	file.write((const char*) &levels[0], levelCount*sizeof(TextureCacheLevel));
+	for (int l=0; l<levelCount; l++)
+		file.write((const char*) &data[l][0], data[l].size());
+	if (!file.good()) {
+		file.close();
+		remove(path.c_str());
+		cout << "Could not write texture cache: " << path << endl;
+	}
 }
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+/* Read the mip chain of the bound texture back, compressing it first when textureFormat asks for it,
+ * and store it in the texture cache for the next launch */
+void writeTextureCache (TextureJob& job)
 {
-	struct VAO* vao = new struct VAO;
-	vao->PrimitiveMode = primitive_mode;
-	vao->NumVertices = numVertices;
-	vao->FillMode = fill_mode;
+	int levelCount = 1;
+	while ((job.width >> levelCount) > 0 || (job.height >> levelCount) > 0)
+		levelCount++;
+
+	vector<TextureCacheLevel> levels(levelCount);
+	vector< vector<unsigned char> > data(levelCount);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (int l=0; l<levelCount; l++) {
+		GLint width, height;
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, l, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, l, GL_TEXTURE_HEIGHT, &height);
+		levels[l].width = width;
+		levels[l].height = height;
+		levels[l].reserved = 0;
+		data[l].resize(width*height*3);
+		glGetTexImage(GL_TEXTURE_2D, l, GL_RGB, GL_UNSIGNED_BYTE, &data[l][0]);
+	}
 
-	// Create Vertex Array Object
-	// Should be done after CreateWindow and before any other GL calls
-	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+	// The driver compresses each generated level on upload, then hands the blocks back
+	if (textureFormat != GL_RGB) {
+		for (int l=0; l<levelCount; l++)
+			glTexImage2D(GL_TEXTURE_2D, l, textureFormat, levels[l].width, levels[l].height, 0, GL_RGB, GL_UNSIGNED_BYTE, &data[l][0]);
+		for (int l=0; l<levelCount; l++) {
+			GLint size;
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, l, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+			data[l].resize(size);
+			glGetCompressedTexImage(GL_TEXTURE_2D, l, &data[l][0]);
+		}
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-	glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-	glVertexAttribPointer(
-			0,                  // attribute 0. Vertices
-			3,                  // size (x,y,z)
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-			);
+	for (int l=0; l<levelCount; l++)
+		Startup.textureBytes += data[l].size();
+	writeTextureCacheFile(job.filename, job.sourceHash, 1, levels, data);
+}
 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-	glVertexAttribPointer(
-			1,                  // attribute 1. Color
-			3,                  // size (r,g,b)
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-			);
+struct TextureDecoder {
+	vector<TextureJob>* jobs;
+	vector<std::thread> workers;
+	std::atomic<size_t> next; // index of the next job to claim
+	double start;
+};
 
-	return vao;
+/* Read and decode one image - safe to call off the context thread, no GL here */
+void decodeTexture (TextureJob& job)
+{
+	TraceScope trace("decode", job.filename);
+	AssetView asset;
+	vector<unsigned char> storage;
+	job.width = job.height = 0;
+	job.pixels = NULL;
+	job.cache.clear();
+	job.error.clear();
+	if (!loadAsset(job.filename, asset, storage)) {
+		job.error = "cannot read the file";
+		return;
+	}
+	job.sourceHash = hashBytes(asset.data, asset.size);
+	if (readTextureCache(job))
+		return;
+	job.pixels = SOIL_load_image_from_memory(asset.data, asset.size, &job.width, &job.height, 0, SOIL_LOAD_RGB);
+	if (!job.pixels)
+		job.error = SOIL_last_result();
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+void textureWorker (TextureDecoder* decoder, int index)
 {
-	GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-	for (int i=0; i<numVertices; i++) {
-		color_buffer_data [3*i] = red;
-		color_buffer_data [3*i + 1] = green;
-		color_buffer_data [3*i + 2] = blue;
+	traceThread = index + 1;
+	traceThreadName("texture decode " + std::to_string(index));
+	size_t i;
+	while ((i = decoder->next++) < decoder->jobs->size()) {
+		decodeTexture((*decoder->jobs)[i]);
+		(*decoder->jobs)[i].finished = (glfwGetTime() - decoder->start) * 1000;
 	}
+}
 
-	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+/* Decode every job on a pool of worker threads, returns at once */
+void startTextureDecode (TextureDecoder& decoder, vector<TextureJob>& jobs)
+{
+	decoder.jobs = &jobs;
+	decoder.next = 0;
+	decoder.start = glfwGetTime();
+	size_t threads = std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 2;
+	threads = min(threads, jobs.size());
+	for (size_t t=0; t<threads; t++)
+		decoder.workers.push_back(std::thread(textureWorker, &decoder, (int)t));
+	Startup.textures = jobs.size();
+	Startup.threads = threads;
 }
 
-struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, GLuint textureID, GLenum fill_mode=GL_FILL)
+/* Wait for the workers started by startTextureDecode */
+void finishTextureDecode (TextureDecoder& decoder)
 {
-	struct VAO* vao = new struct VAO;
-	vao->PrimitiveMode = primitive_mode;
-	vao->NumVertices = numVertices;
-	vao->FillMode = fill_mode;
-	vao->TextureID = textureID;
+	TraceScope trace("finishTextureDecode");
+	double waitStart = glfwGetTime();
+	for (size_t t=0; t<decoder.workers.size(); t++)
+		decoder.workers[t].join();
+	decoder.workers.clear();
+	Startup.wait += (glfwGetTime() - waitStart) * 1000;
+	// Decoding took until the last job was done, not until the join got round to it
+	double decode = 0;
+	for (size_t j=0; j<decoder.jobs->size(); j++)
+		decode = max(decode, (*decoder.jobs)[j].finished);
+	Startup.decode += decode;
+}
 
-	// Create Vertex Array Object
-	// Should be done after CreateWindow and before any other GL calls
-	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->TextureBuffer));  // VBO - textures
+/* Create the OpenGL texture of a decoded job and free its pixels */
+void uploadTexture (TextureJob& job)
+{
+	TraceScope trace("upload", job.filename);
+	double start = glfwGetTime();
+	size_t bytes = Startup.textureBytes;
+	// All upcoming GL_TEXTURE_2D operations now have effect on our texture buffer
+	glBindTexture(GL_TEXTURE_2D, job.TextureID);
+	// Set our texture parameters
+	// Set texture wrapping to GL_REPEAT
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	// Set texture filtering (interpolation)
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-	glBindVertexArray (vao->VertexArrayID); // Bind the VAO
-	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-	glVertexAttribPointer(
-			0,                  // attribute 0. Vertices
-			3,                  // size (x,y,z)
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-			);
+	if (!job.cache.empty())
+		uploadCachedTexture(job);
+	else {
+		if (!job.pixels)
+			cout << "SOIL loading error: '" << job.filename << "': " << job.error << endl;
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, job.width, job.height, 0, GL_RGB, GL_UNSIGNED_BYTE, job.pixels);
+		glGenerateMipmap(GL_TEXTURE_2D); // Generate MipMaps to use
+		if (job.pixels) {
+			writeTextureCache(job);
+			SOIL_free_image_data(job.pixels); // Free the data read from file after creating opengl texture
+		}
+		job.pixels = NULL;
+	}
+	glBindTexture(GL_TEXTURE_2D, 0); // Unbind texture when done, so we won't accidentily mess it up
+	setResourceBytes(job.Texture, Startup.textureBytes - bytes);
+	Startup.upload += (glfwGetTime() - start) * 1000;
+}
 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->TextureBuffer); // Bind the VBO textures
-	glBufferData (GL_ARRAY_BUFFER, 2*numVertices*sizeof(GLfloat), texture_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-	glVertexAttribPointer(
-			2,                  // attribute 2. Textures
-			2,                  // size (s,t)
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-			);
+/* Drop a decoded image that is not needed after all - its texture name stays empty */
+void skipTextureUpload (TextureJob& job)
+{
+	TraceScope trace("skip upload", job.filename);
+	if (job.pixels)
+		SOIL_free_image_data(job.pixels);
+	job.pixels = NULL;
+	job.cache.clear();
+}
 
-	return vao;
+/* Resample every material's texture to the common layer size into the bound material array, with its mip chain.
+ * Level 0 is read back through the driver (which decodes compressed textures), the mip chain is regenerated
+ * for the array, and with a compressed textureFormat it is compressed the way writeTextureCache does */
+void fillMaterialArray (const vector<int>& widths, const vector<int>& heights, int levelCount)
+{
+	// Nearest resampling from pixel centres, the layers are drawn with nearest filtering anyway
+	int layers = Materials.layers.size();
+	int layerSize = Materials.width*Materials.height*3;
+	vector<unsigned char> pixels(layerSize*layers), source;
+	for (int l=0; l<layers; l++) {
+		source.resize(widths[l]*heights[l]*3);
+		glBindTexture(GL_TEXTURE_2D, resourceName(Materials.layers[l]));
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_BYTE, &source[0]);
+		unsigned char* layer = &pixels[l*layerSize];
+		for (int y=0; y<Materials.height; y++) {
+			int sy = (2*y + 1)*heights[l]/(2*Materials.height);
+			for (int x=0; x<Materials.width; x++)
+				memcpy(&layer[3*(y*Materials.width + x)], &source[3*(sy*widths[l] + (2*x + 1)*widths[l]/(2*Materials.width))], 3);
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB, Materials.width, Materials.height, layers, 0, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	if (textureFormat != GL_RGB) {
+		vector< vector<unsigned char> > levels(levelCount);
+		vector<GLint> levelWidths(levelCount), levelHeights(levelCount);
+		for (int l=0; l<levelCount; l++) {
+			glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, l, GL_TEXTURE_WIDTH, &levelWidths[l]);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, l, GL_TEXTURE_HEIGHT, &levelHeights[l]);
+			levels[l].resize(levelWidths[l]*levelHeights[l]*3*layers);
+			glGetTexImage(GL_TEXTURE_2D_ARRAY, l, GL_RGB, GL_UNSIGNED_BYTE, &levels[l][0]);
+		}
+		for (int l=0; l<levelCount; l++)
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, l, textureFormat, levelWidths[l], levelHeights[l], layers, 0, GL_RGB, GL_UNSIGNED_BYTE, &levels[l][0]);
+	}
 }
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* Read the finished array back, every level in textureFormat, and store it in the texture cache under 'key' */
+void writeMaterialCache (uint64_t key, int levelCount)
 {
-	// Change the Fill Mode for this object
-	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+	int layers = Materials.layers.size();
+	vector<TextureCacheLevel> levels(levelCount);
+	vector< vector<unsigned char> > data(levelCount);
+	for (int l=0; l<levelCount; l++) {
+		GLint width, height;
+		glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, l, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, l, GL_TEXTURE_HEIGHT, &height);
+		levels[l].width = width;
+		levels[l].height = height;
+		levels[l].reserved = 0;
+		if (textureFormat != GL_RGB) {
+			GLint size;
+			glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, l, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+			data[l].resize(size);
+			glGetCompressedTexImage(GL_TEXTURE_2D_ARRAY, l, &data[l][0]);
+		}
+		else {
+			data[l].resize(width*height*3*layers);
+			glGetTexImage(GL_TEXTURE_2D_ARRAY, l, GL_RGB, GL_UNSIGNED_BYTE, &data[l][0]);
+		}
+	}
+	writeTextureCacheFile(MATERIAL_CACHE_NAME, key, layers, levels, data);
+}
 
-	// Bind the VAO to use
-	glBindVertexArray (vao->VertexArrayID);
+/* Create the material array texture, bound to GL_TEXTURE_2D_ARRAY for filling */
+void createMaterialTexture ()
+{
+	Materials.Texture = createTextureName(MEMORY_TEXTURES, "material array");
+	Materials.TextureID = resourceName(Materials.Texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, Materials.TextureID);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
 
-	// Enable Vertex Attribute 0 - 3d Vertices
-	glEnableVertexAttribArray(0);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+/* Key the material array by the images behind its layers, as the decode workers hashed them, and upload it
+ * straight from the texture cache. Returns false on a miss - the sources then have to be uploaded for
+ * buildMaterialArray. On a hit they never are, and Startup.uploadsSkipped counts them */
+bool loadMaterialArray (const vector<TextureJob>& jobs)
+{
+	TraceScope trace("loadMaterialArray");
+	int layers = Materials.layers.size();
+	Materials.key = 0;
+	if (!layers)
+		return false;
+
+	// The layer order is part of the key, it is baked into the meshes
+	vector<uint64_t> sources(layers, 0);
+	int skipped = 0;
+	for (size_t j=0; j<jobs.size(); j++) {
+		bool loaded = !jobs[j].cache.empty() || jobs[j].pixels;
+		for (int l=0; l<layers; l++)
+			if (sameResource(Materials.layers[l], jobs[j].Texture)) {
+				sources[l] = loaded ? jobs[j].sourceHash : 0;
+				skipped++;
+				break;
+			}
+	}
+	for (int l=0; l<layers; l++)
+		if (!sources[l])
+			return false;
+	Materials.key = hashBytes((const unsigned char*) &sources[0], layers*sizeof(uint64_t));
+
+	TextureJob cached;
+	cached.filename = MATERIAL_CACHE_NAME;
+	cached.sourceHash = Materials.key;
+	if (!readTextureCache(cached, layers))
+		return false;
+
+	// The layer size comes from the cache, the sources are never looked at
+	const TextureCacheHeader* header = (const TextureCacheHeader*) &cached.cache[0];
+	const TextureCacheLevel* levels = (const TextureCacheLevel*) (header + 1);
+	const unsigned char* data = (const unsigned char*) (levels + header->levels);
+	Materials.width = levels[0].width;
+	Materials.height = levels[0].height;
+	createMaterialTexture();
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	size_t bytes = 0;
+	for (uint32_t l=0; l<header->levels; l++) {
+		if (header->internalFormat == GL_RGB)
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, l, GL_RGB, levels[l].width, levels[l].height, layers, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+		else
+			glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, l, header->internalFormat, levels[l].width, levels[l].height, layers, 0, levels[l].size, data);
+		data += levels[l].size;
+		bytes += levels[l].size;
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, header->levels - 1);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	setResourceBytes(Materials.Texture, bytes);
+	Startup.uploadsSkipped = skipped;
+	cout << "MATERIALS: " << layers << " layers of " << Materials.width << "x" << Materials.height << ", " << bytes/1024 << " KB from texture cache, " << skipped << " source uploads skipped" << endl;
+	return true;
+}
 
-	// Enable Vertex Attribute 1 - Color
-	glEnableVertexAttribArray(1);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+/* Copy every material's uploaded texture into the material array and store the result in the texture cache for
+ * loadMaterialArray. Either way the layers' references to their sources are dropped */
+void buildMaterialArray ()
+{
+	TraceScope trace("buildMaterialArray");
+	int layers = Materials.layers.size();
+	if (!layers || Materials.TextureID) {
+		for (int l=0; l<layers; l++)
+			releaseResource(Materials.layers[l]);
+		Materials.layers.clear();
+		return;
+	}
+	vector<int> widths(layers), heights(layers);
+	Materials.width = Materials.height = 1;
+	for (int l=0; l<layers; l++) {
+		glBindTexture(GL_TEXTURE_2D, resourceName(Materials.layers[l]));
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &widths[l]);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &heights[l]);
+		Materials.width = max(Materials.width, widths[l]);
+		Materials.height = max(Materials.height, heights[l]);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	int levelCount = 1;
+	while ((Materials.width >> levelCount) > 0 || (Materials.height >> levelCount) > 0)
+		levelCount++;
+
+	createMaterialTexture();
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	fillMaterialArray(widths, heights, levelCount);
+	if (Materials.key)
+		writeMaterialCache(Materials.key, levelCount);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	size_t bytes = 0;
+	for (int l=0; l<levelCount; l++) {
+		if (textureFormat != GL_RGB) {
+			GLint size = 0;
+			glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, l, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+			bytes += size;
+		}
+		else
+			bytes += max(1, Materials.width >> l) * max(1, Materials.height >> l) * 3 * layers;
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	for (int l=0; l<layers; l++)
+		releaseResource(Materials.layers[l]);
+	Materials.layers.clear();
+	setResourceBytes(Materials.Texture, bytes);
+	cout << "MATERIALS: " << layers << " layers of " << Materials.width << "x" << Materials.height << ", " << bytes/1024 << " KB, built from the uploaded sources" << endl;
+}
 
-	// Draw the geometry !
-	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+void destroyMaterialArray ()
+{
+	for (size_t l=0; l<Materials.layers.size(); l++)
+		releaseResource(Materials.layers[l]);
+	Materials.layers.clear();
+	releaseResource(Materials.Texture);
+	Materials.TextureID = 0;
 }
 
-void draw3DTexturedObject (struct VAO* vao)
+/* Create an OpenGL Texture from an image, decoding on the calling thread */
+TextureHandle createTexture (const char* filename)
 {
-	// Change the Fill Mode for this object
-	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+	TextureJob job;
+	job.filename = filename;
+	// Generate Texture Buffer
+	job.Texture = createTextureName(MEMORY_TEXTURES, filename);
+	job.TextureID = resourceName(job.Texture);
+	decodeTexture(job);
+	uploadTexture(job);
+	return job.Texture;
+}
 
-	// Bind the VAO to use
-	glBindVertexArray (vao->VertexArrayID);
+/* Point the FrameData block of a program at the shared binding point */
+void bindFrameData (GLuint program)
+{
+	GLuint blockIndex = glGetUniformBlockIndex(program, "FrameData");
+	if (blockIndex != GL_INVALID_INDEX)
+		glUniformBlockBinding(program, blockIndex, FRAME_DATA_BINDING);
+}
 
-	// Enable Vertex Attribute 0 - 3d Vertices
-	glEnableVertexAttribArray(0);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+/* Stream this frame's camera data through the upload ring and bind it - done once per frame, before any draw */
+void uploadFrameData ()
+{
+	FrameData.Offset = uploadRingWrite(&FrameData.data, sizeof(GLFrameData), UploadRing.UniformAlignment);
+	if (FrameData.Offset >= 0)
+		glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, UploadRing.Buffer, FrameData.Offset, sizeof(GLFrameData));
+}
 
-	// Bind Textures using texture units
-	glBindTexture(GL_TEXTURE_2D, vao->TextureID);
+/* Glyph atlas text: arial.ttf is rasterized once into a single channel texture, and every string queued
+ * during a frame becomes textured quads in the upload ring, drawn with one glDrawArrays.
+ * fontrender.vert adds the pen with w = 1 to the vertex with w = 1, so FTGL's FaceSize(1) glyphs come out half an em
+ * high while the string offset is not scaled. Glyph metrics are kept in the same half ems, so strings land where
+ * FTGL put them */
+#define GLYPH_ATLAS_SIZE 512
+#define GLYPH_PIXEL_SIZE 48 // rasterized em size
+#define GLYPH_EM 0.5f       // HUD units per em, as FTGL draws it
+#define GLYPH_PADDING 4     // keeps neighbours out of the filtered mip levels
+#define GLYPH_FIRST 32      // printable ASCII only
+#define GLYPH_COUNT 95
+
+struct AtlasGlyph {
+	float u0, v0, u1, v1;
+	float left, bottom, right, top; // quad relative to the pen on the baseline, in HUD units
+	float advance;
+};
 
-	// Enable Vertex Attribute 2 - Texture
-	glEnableVertexAttribArray(2);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->TextureBuffer);
+struct TextVertex {
+	float position[4]; // xy = HUD plane, zw = atlas coordinates
+	float color[3];
+};
 
-	// Draw the geometry !
-	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+struct GlyphAtlas {
+	GLuint TextureID;
+	GLuint VertexArrayID;
+	TextureHandle Texture;
+	VertexArrayHandle VertexArray;
+	GLuint programID;
+	AtlasGlyph glyphs[GLYPH_COUNT];
+	vector<TextVertex> vertices; // queued this frame
+	glm::vec3 color;             // for strings queued from now on
+	int draws;                   // glDrawArrays calls issued for text
+} TextAtlas;
+
+int textRenderer = TEXT_FTGL; // renderer actually in use
+
+void setupTextAtlasProgram (GLuint program)
+{
+	bindFrameData(program);
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "atlas"), 0);
+}
+
+/* Rasterize the printable ASCII glyphs of 'fontfile' into the atlas texture, returns false when FreeType fails */
+bool buildGlyphAtlas (const char* fontfile)
+{
+	TraceScope trace("buildGlyphAtlas", fontfile);
+	AssetView asset;
+	vector<unsigned char> storage;
+	FT_Library library;
+	FT_Face face;
+	if (!loadAsset(fontfile, asset, storage) || FT_Init_FreeType(&library))
+		return false;
+	if (FT_New_Memory_Face(library, asset.data, asset.size, 0, &face)) {
+		FT_Done_FreeType(library);
+		return false;
+	}
+	FT_Set_Pixel_Sizes(face, 0, GLYPH_PIXEL_SIZE);
+
+	// Shelf packing: glyphs left to right, a new row when one is full
+	vector<unsigned char> pixels(GLYPH_ATLAS_SIZE*GLYPH_ATLAS_SIZE, 0);
+	int penX = GLYPH_PADDING, penY = GLYPH_PADDING, rowHeight = 0;
+	bool fits = true;
+	for (int c=0; c<GLYPH_COUNT && fits; c++) {
+		AtlasGlyph& glyph = TextAtlas.glyphs[c];
+		memset(&glyph, 0, sizeof(glyph));
+		if (FT_Load_Char(face, GLYPH_FIRST + c, FT_LOAD_RENDER))
+			continue;
+		FT_GlyphSlot slot = face->glyph;
+		int width = slot->bitmap.width, rows = slot->bitmap.rows;
+		if (penX + width + GLYPH_PADDING > GLYPH_ATLAS_SIZE) {
+			penX = GLYPH_PADDING;
+			penY += rowHeight + GLYPH_PADDING;
+			rowHeight = 0;
+		}
+		if (penY + rows + GLYPH_PADDING > GLYPH_ATLAS_SIZE) {
+			fits = false;
+			break;
+		}
+		for (int r=0; r<rows; r++)
+			memcpy(&pixels[(penY + r)*GLYPH_ATLAS_SIZE + penX], slot->bitmap.buffer + r*slot->bitmap.pitch, width);
+
+		glyph.u0 = (float) penX / GLYPH_ATLAS_SIZE;
+		glyph.v0 = (float) penY / GLYPH_ATLAS_SIZE;
+		glyph.u1 = (float) (penX + width) / GLYPH_ATLAS_SIZE;
+		glyph.v1 = (float) (penY + rows) / GLYPH_ATLAS_SIZE;
+		glyph.left = GLYPH_EM * slot->bitmap_left / GLYPH_PIXEL_SIZE;
+		glyph.top = GLYPH_EM * slot->bitmap_top / GLYPH_PIXEL_SIZE;
+		glyph.right = glyph.left + GLYPH_EM * width / GLYPH_PIXEL_SIZE;
+		glyph.bottom = glyph.top - GLYPH_EM * rows / GLYPH_PIXEL_SIZE;
+		glyph.advance = GLYPH_EM * slot->advance.x / 64.0f / GLYPH_PIXEL_SIZE;
+
+		penX += width + GLYPH_PADDING;
+		rowHeight = max(rowHeight, rows);
+	}
+	FT_Done_Face(face);
+	FT_Done_FreeType(library);
+	if (!fits) {
+		cout << "Glyph atlas of " << GLYPH_ATLAS_SIZE << " pixels is too small for " << fontfile << endl;
+		return false;
+	}
 
-	// Unbind Textures to be safe
+	TextAtlas.Texture = createTextureName(MEMORY_FONTS, "glyph atlas");
+	TextAtlas.TextureID = resourceName(TextAtlas.Texture);
+	glBindTexture(GL_TEXTURE_2D, TextAtlas.TextureID);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE, 0, GL_RED, GL_UNSIGNED_BYTE, &pixels[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glGenerateMipmap(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, 0);
+	setResourceBytes(TextAtlas.Texture, GLYPH_ATLAS_SIZE*GLYPH_ATLAS_SIZE*4/3); // R8 and its mip chain
+
+	// Attribute pointers move with the ring, so they are set on every flush
+	TextAtlas.VertexArray = createVertexArray(MEMORY_FONTS, "glyph atlas");
+	TextAtlas.VertexArrayID = resourceName(TextAtlas.VertexArray);
+	glBindVertexArray(TextAtlas.VertexArrayID);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glBindVertexArray(0);
+	return true;
 }
 
-/* Create an OpenGL Texture from an image */
-GLuint createTexture (const char* filename)
+void destroyGlyphAtlas ()
 {
-	GLuint TextureID;
-	// Generate Texture Buffer
-	glGenTextures(1, &TextureID);
-	// All upcoming GL_TEXTURE_2D operations now have effect on our texture buffer
-	glBindTexture(GL_TEXTURE_2D, TextureID);
-	// Set our texture parameters
-	// Set texture wrapping to GL_REPEAT
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	// Set texture filtering (interpolation)
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	releaseResource(TextAtlas.Texture);
+	releaseResource(TextAtlas.VertexArray);
+	TextAtlas.TextureID = TextAtlas.VertexArrayID = 0;
+}
 
-	// Load image and create OpenGL texture
-	int twidth, theight;
-	unsigned char* image = SOIL_load_image(filename, &twidth, &theight, 0, SOIL_LOAD_RGB);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, twidth, theight, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-	glGenerateMipmap(GL_TEXTURE_2D); // Generate MipMaps to use
-	SOIL_free_image_data(image); // Free the data read from file after creating opengl texture
-	glBindTexture(GL_TEXTURE_2D, 0); // Unbind texture when done, so we won't accidentily mess it up
+/* Queue the quads of 'text' with its baseline starting at (x, y) on the HUD plane, 'size' ems high */
+void queueAtlasText (float x, float y, const char* text, float size=1)
+{
+	float pen = x;
+	for (const char* c = text; *c; c++) {
+		int index = (unsigned char) *c - GLYPH_FIRST;
+		if (index < 0 || index >= GLYPH_COUNT)
+			continue;
+		const AtlasGlyph& glyph = TextAtlas.glyphs[index];
+		if (glyph.right > glyph.left) {
+			float x0 = pen + glyph.left*size, x1 = pen + glyph.right*size;
+			float y0 = y + glyph.bottom*size, y1 = y + glyph.top*size;
+			TextVertex corners[4] = {
+				{ { x0, y0, glyph.u0, glyph.v1 }, { TextAtlas.color.x, TextAtlas.color.y, TextAtlas.color.z } },
+				{ { x1, y0, glyph.u1, glyph.v1 }, { TextAtlas.color.x, TextAtlas.color.y, TextAtlas.color.z } },
+				{ { x1, y1, glyph.u1, glyph.v0 }, { TextAtlas.color.x, TextAtlas.color.y, TextAtlas.color.z } },
+				{ { x0, y1, glyph.u0, glyph.v0 }, { TextAtlas.color.x, TextAtlas.color.y, TextAtlas.color.z } }
+			};
+			const int order[6] = { 0, 1, 2, 2, 3, 0 };
+			for (int v=0; v<6; v++)
+				TextAtlas.vertices.push_back(corners[order[v]]);
+		}
+		pen += glyph.advance*size;
+	}
+}
+
+/* Draw 'count' text vertices stored at 'offset' in 'buffer' */
+void drawAtlasQuads (GLuint buffer, GLintptr offset, GLsizei count)
+{
+	glUseProgram(TextAtlas.programID);
+	glBindVertexArray(TextAtlas.VertexArrayID);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void*) (offset + offsetof(TextVertex, position)));
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void*) (offset + offsetof(TextVertex, color)));
+	glBindTexture(GL_TEXTURE_2D, TextAtlas.TextureID);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDrawArrays(GL_TRIANGLES, 0, count);
+	glDisable(GL_BLEND);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	TextAtlas.draws++;
+}
 
-	return TextureID;
+/* Stream the queued quads through the upload ring and draw them all at once */
+void flushAtlasText ()
+{
+	if (TextAtlas.vertices.empty())
+		return;
+	GLintptr offset = uploadRingWrite(&TextAtlas.vertices[0], TextAtlas.vertices.size()*sizeof(TextVertex), sizeof(float));
+	if (offset >= 0)
+		drawAtlasQuads(UploadRing.Buffer, offset, TextAtlas.vertices.size());
+	TextAtlas.vertices.clear();
 }
 
 /**************************
@@ -344,7 +2624,7 @@ double start_time = 0,curr_time =0,starttime=0,currenttime = 0;
 int speedfactor = 4,won=0,lost=0;
 int countright = 0,countleft = 0,countup = 0,countdown = 0,countrightjump = 0,countleftjump = 0,countupjump = 0,countdownjump = 0;
 int freflag = 0;
-VAO *rect1,*rect2,*rect3,*rect4,*rect5,*rect6,*back;
+VAO *rect1,*rect2,*rect3,*rect4,*rect6,*back;
 int timesppp = 0,die = 0;
 class player
 {
@@ -1039,20 +3319,20 @@ class player
 		{
 			const  GLfloat vertex_buffer_data [] = {
 				0,0,0,
-				x,0,0,
 				x,y,0,
+				x,0,0,
 
 				x,y,0,
-				0,y,0,
 				0,0,0,
+				0,y,0,
 
 				0,0,0,
-				0,y,0,
 				0,y,z,
+				0,y,0,
 
 				0,y,z,
-				0,0,z,
 				0,0,0,
+				0,0,z,
 
 				0,y,0,
 				0,y,z,
@@ -1063,12 +3343,12 @@ class player
 				0,y,0,
 
 				0,0,0,
-				0,0,z,
 				x,0,z,
+				0,0,z,
 
 				x,0,z,
-				x,0,0,
 				0,0,0,
+				x,0,0,
 
 				0,0,z,
 				x,0,z,
@@ -1142,14 +3422,15 @@ class player
 				float rad;
 				float color1;
 			public:
-				VAO* createCircle()
+				VAO* createCircle(int segments)
 				{
-					GLfloat* vertex_buffer_data = new GLfloat [3*360];
-					GLfloat* color_buffer_data = new GLfloat [3*360];
-					for(int i=0;i<360;i++)
+					vector<GLfloat> vertex_buffer_data(3*segments);
+					vector<GLfloat> color_buffer_data(3*segments);
+					for(int i=0;i<segments;i++)
 					{
-						vertex_buffer_data [3*i] = (rad * cos(DEG2RAD(i)));
-						vertex_buffer_data [3*i + 1] = (rad * sin(DEG2RAD(i)));
+						float degrees = i*360.0f/segments;
+						vertex_buffer_data [3*i] = (rad * cos(DEG2RAD(degrees)));
+						vertex_buffer_data [3*i + 1] = (rad * sin(DEG2RAD(degrees)));
 						vertex_buffer_data [3*i + 2] = 1;
 						if(i%2==0)
 						{
@@ -1164,7 +3445,7 @@ class player
 							color_buffer_data [3*i + 2] = 0.587;
 						}
 					}
-					return create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
+					return create3DObject(GL_TRIANGLE_FAN, segments, &vertex_buffer_data[0], &color_buffer_data[0], GL_FILL);
 				}
 		}obstacle;
 
@@ -1173,6 +3454,7 @@ class player
 		void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 		{
 			// Function is called first on GLFW_PRESS.
+			Idle.wake = true;
 
 			if (action == (GLFW_PRESS || GLFW_REPEAT)) {
 				switch (key) {
@@ -1257,6 +3539,45 @@ class player
 						if(speedfactor >= 1)
 							speedfactor -= 1;
 						break;
+					case GLFW_KEY_I:
+						// switch scene submission path, for A/B timing with --bench-scene
+						if(scenePath == SCENE_PATH_INDIRECT)
+							scenePath = SCENE_PATH_INSTANCED;
+						else if(indirectSupported())
+							scenePath = SCENE_PATH_INDIRECT;
+						cout << "SCENE PATH: " << (scenePath == SCENE_PATH_INDIRECT ? "multi draw indirect" : "instanced") << endl;
+						break;
+					case GLFW_KEY_V:
+						// picture-in-picture views of every camera
+						multiView = !multiView;
+						cout << "MULTI VIEW: " << (multiView ? "on" : "off") << endl;
+						break;
+					case GLFW_KEY_M:
+						minimap = !minimap;
+						cout << "MINIMAP: " << (minimap ? "on" : "off") << endl;
+						break;
+					case GLFW_KEY_C:
+						// A/B the overdraw with --overdraw
+						cullFaces = !cullFaces;
+						cout << "BACK-FACE CULLING: " << (cullFaces ? "on" : "off") << endl;
+						break;
+					case GLFW_KEY_P:
+						depthPrepass = !depthPrepass;
+						cout << "DEPTH PREPASS: " << (depthPrepass ? "on" : "off") << endl;
+						break;
+					case GLFW_KEY_H:
+						heatmap = !heatmap;
+						cout << "HEATMAP: " << (heatmap ? "on" : "off") << endl;
+						break;
+					case GLFW_KEY_G:
+						// A/B the program switches with --bench-scene
+						uberShader = !uberShader;
+						cout << "SCENE SHADER: " << (uberShader ? "uber" : "split") << endl;
+						break;
+					case GLFW_KEY_O:
+						profilerOverlay = !profilerOverlay;
+						cout << "PROFILER OVERLAY: " << (profilerOverlay ? "on" : "off") << endl;
+						break;
 					case GLFW_KEY_N:
 						won = 0;
 						lost = 0;
@@ -1489,6 +3810,7 @@ class player
 			/* Executed when a mouse button is pressed/released */
 			void mouseButton (GLFWwindow* window, int button, int action, int mods)
 			{
+				Idle.wake = true;
 				switch (button) {
 					case GLFW_MOUSE_BUTTON_LEFT:
 						if (action == GLFW_PRESS || action == GLFW_REPEAT)
@@ -1508,6 +3830,7 @@ class player
 
 			void scrollback(GLFWwindow* window,double x,double y)
 			{
+				Idle.wake = true;
 				float add = float(y)/10;
 				zoom = zoom+add;
 				if(zoom >= 0.9 && zoom < 1.5)
@@ -1538,6 +3861,7 @@ class player
 
 			void mouse(GLFWwindow* window,double x,double y)
 			{
+				Idle.wake = true;
 				if(heliview == 1)
 				{
 					eyex = y - 150;
@@ -1553,6 +3877,7 @@ class player
 			/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
 			void reshapeWindow (GLFWwindow* window, int width, int height)
 			{
+				Idle.wake = true;
 				int fbwidth=width, fbheight=height;
 				/* With Retina display on Mac OS X, GLFW's FramebufferSize
 				   is different from WindowSize */
@@ -1568,13 +3893,33 @@ class player
 				// Store the projection matrix in a variable for future use
 				// Perspective projection for 3D views
 				Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
+				screenWidth = fbwidth;
+				screenHeight = fbheight;
 
 				// Ortho projection for 2D views
 				//Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
 			}
 
+			/* Executed when the window gains or loses input focus */
+			void windowFocus (GLFWwindow* window, int focused)
+			{
+				Idle.focused = focused;
+				Idle.wake = true;
+			}
+
+			/* Executed when the window is minimised or restored */
+			void windowIconify (GLFWwindow* window, int iconified)
+			{
+				Idle.iconified = iconified;
+				Idle.wake = true;
+			}
+
 			VAO *triangle, *rectangle;
-			VAO *cube,*cubetest,*obstacleex;
+			VAO *cube,*cubetest;
+
+			/* Enemy circle LODs, coarsest first - the last one is the original 360 segment circle */
+			const int enemyLodSegments[ENEMY_LOD_LEVELS] = { 8, 16, 32, 64, ENEMY_LOD_FULL_SEGMENTS };
+			VAO *obstacleLod[ENEMY_LOD_LEVELS];
 
 			VAO* createCube()
 			{
@@ -1584,20 +3929,20 @@ class player
 				const  GLfloat vertex_buffer_data [] = {
 
 					0,0,0,
-					x,0,0,
 					x,y,0,
+					x,0,0,
 
 					x,y,0,
-					0,y,0,
 					0,0,0,
+					0,y,0,
 
 					0,0,0,
-					0,y,0,
 					0,y,z,
+					0,y,0,
 
 					0,y,z,
-					0,0,z,
 					0,0,0,
+					0,0,z,
 
 					0,y,0,
 					0,y,z,
@@ -1608,12 +3953,12 @@ class player
 					0,y,0,
 
 					0,0,0,
-					0,0,z,
 					x,0,z,
+					0,0,z,
 
 					x,0,z,
-					x,0,0,
 					0,0,0,
+					x,0,0,
 
 					0,0,z,
 					x,0,z,
@@ -1635,10 +3980,10 @@ class player
 				const GLfloat color_buffer_data [] = {
 					0.700f,  0.f,  0.f,
 
-					0.195f,  0.548f,  0.859f,
-
 					0.014f,  0.184f,  0.576f,
 
+					0.195f,  0.548f,  0.859f,
+
 					0.8039,0.5215,0.2470,
 					0.8039,0.5215,0.2470,
 					0.8039,0.5215,0.2470,
@@ -1648,10 +3993,10 @@ class player
 
 					0.609f,  0.115f,  0.436f,
 
-					0.327f,  0.483f,  0.844f,
-
 					0.310f,  0.747f,  0.185f,
 
+					0.327f,  0.483f,  0.844f,
+
 					/*0.876f,  0.177f,  0.433f,
 
 					  0.971f,  0.572f,  0.833f,
@@ -1824,7 +4169,7 @@ class player
 			// Creates the rectangle object used in this sample code
 
 
-			VAO* createRectangleUP (GLuint textureID)
+			VAO* createRectangleUP (TextureHandle texture)
 			{
 				x = 30;
 				y = 100;
@@ -1832,12 +4177,12 @@ class player
 				// GL3 accepts only Triangles. Quads are not supported
 				static const GLfloat vertex_buffer_data [] = {
 					0,0,0,
-					x,0,0,
 					x,y,0,
+					x,0,0,
 
 					x,y,0,
-					0,y,0,
 					0,0,0,
+					0,y,0,
 				};
 
 				static const GLfloat color_buffer_data [] = {
@@ -1856,29 +4201,29 @@ class player
 				// Texture coordinates start with (0,0) at top left of the image to (1,1) at bot right
 				static const GLfloat texture_buffer_data [] = {
 					0,1, // TexCoord 1 - bot left
-					1,1, // TexCoord 2 - bot right
 					1,0, // TexCoord 3 - top right
+					1,1, // TexCoord 2 - bot right
 
 					1,0, // TexCoord 3 - top right
-					0,0, // TexCoord 4 - top left
-					0,1  // TexCoord 1 - bot left
+					0,1, // TexCoord 1 - bot left
+					0,0  // TexCoord 4 - top left
 				};
 
 				// create3DTexturedObject creates and returns a handle to a VAO that can be used later
-				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, textureID, GL_FILL);
+				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, texture, GL_FILL);
 			}
 
-			VAO* createRectangleDown (GLuint textureID)
+			VAO* createRectangleDown (TextureHandle texture)
 			{
 				// GL3 accepts only Triangles. Quads are not supported
 				static const GLfloat vertex_buffer_data [] = {
 					0,0,0,
-					0,y,0,
 					0,y,z,
+					0,y,0,
 
 					0,y,z,
-					0,0,z,
 					0,0,0,
+					0,0,z,
 				};
 
 				static const GLfloat color_buffer_data [] = {
@@ -1898,19 +4243,19 @@ class player
 				// Texture coordinates start with (0,0) at top left of the image to (1,1) at bot right
 				static const GLfloat texture_buffer_data [] = {
 					0,1, // TexCoord 1 - bot left
-					1,1, // TexCoord 2 - bot right
 					1,0, // TexCoord 3 - top right
+					1,1, // TexCoord 2 - bot right
 
 					1,0, // TexCoord 3 - top right
-					0,0, // TexCoord 4 - top left
-					0,1  // TexCoord 1 - bot left
+					0,1, // TexCoord 1 - bot left
+					0,0  // TexCoord 4 - top left
 				};
 
 				// create3DTexturedObject creates and returns a handle to a VAO that can be used later
-				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, textureID, GL_FILL);
+				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, texture, GL_FILL);
 			}
 
-			VAO* createRectangleLeft (GLuint textureID)
+			VAO* createRectangleLeft (TextureHandle texture)
 			{
 				// GL3 accepts only Triangles. Quads are not supported
 				static const GLfloat vertex_buffer_data [] = {
@@ -1945,10 +4290,10 @@ class player
 				};
 
 				// create3DTexturedObject creates and returns a handle to a VAO that can be used later
-				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, textureID, GL_FILL);
+				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, texture, GL_FILL);
 			}
 
-			VAO* createRectangleRight (GLuint textureID)
+			VAO* createRectangleRight (TextureHandle texture)
 			{
 				// GL3 accepts only Triangles. Quads are not supported
 				static const GLfloat vertex_buffer_data [] = {
@@ -1984,10 +4329,10 @@ class player
 				};
 
 				// create3DTexturedObject creates and returns a handle to a VAO that can be used later
-				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, textureID, GL_FILL);
+				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, texture, GL_FILL);
 			}
 
-			VAO* createRectangleFront (GLuint textureID)
+			VAO* createRectangleFront (TextureHandle texture)
 			{
 				// GL3 accepts only Triangles. Quads are not supported
 				static const GLfloat vertex_buffer_data [] = {
@@ -2011,122 +4356,1216 @@ class player
 
 					0.517f,  0.713f,  0.338f,
 
-					0.053f,  0.459f,  0.120f,
+					0.053f,  0.459f,  0.120f,
+
+					0.347f,  0.257f,  0.137f,
+
+
+				};
+
+				// Texture coordinates start with (0,0) at top left of the image to (1,1) at bot right
+				static const GLfloat texture_buffer_data [] = {
+					0,1, // TexCoord 1 - bot left
+					1,1, // TexCoord 2 - bot right
+					1,0, // TexCoord 3 - top right
+
+					1,0, // TexCoord 3 - top right
+					0,0, // TexCoord 4 - top left
+					0,1  // TexCoord 1 - bot left
+				};
+
+				// create3DTexturedObject creates and returns a handle to a VAO that can be used later
+				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, texture, GL_FILL);
+			}
+
+			VAO* createRectangleBack (TextureHandle texture)
+			{
+				// GL3 accepts only Triangles. Quads are not supported
+				static const GLfloat vertex_buffer_data [] = {
+					x,0,z,
+					x,0,0,
+					x,y,0,
+
+					x,y,0,
+					x,y,z,
+					x,0,z
+				};
+
+				static const GLfloat color_buffer_data [] = {
+					0.655f,  0.653f,  0.042f,
+
+					0.714f,  0.505f,  0.345f,
+
+					0.393f,  0.621f,  0.862f,
+
+					0.673f,  0.211f,  0.457f,
+
+					0.520f,  0.583f,  0.171f,
+
+					0.982f,  0.099f,  0.879f
+				};
+
+				// Texture coordinates start with (0,0) at top left of the image to (1,1) at bot right
+				static const GLfloat texture_buffer_data [] = {
+					0,1, // TexCoord 1 - bot left
+					1,1, // TexCoord 2 - bot right
+					1,0, // TexCoord 3 - top right
+
+					1,0, // TexCoord 3 - top right
+					0,0, // TexCoord 4 - top left
+					0,1  // TexCoord 1 - bot left
+				};
+
+				// create3DTexturedObject creates and returns a handle to a VAO that can be used later
+				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, texture, GL_FILL);
+			}
+
+			VAO* createRectangle (TextureHandle texture)
+			{
+				// GL3 accepts only Triangles. Quads are not supported
+				static const GLfloat vertex_buffer_data [] = {
+					0,0,0, // vertex 1
+					10000,0,10000, // vertex 3
+					10000,0,0, // vertex 2
+
+					10000,0,10000, // vertex 3
+					0,0,0, // vertex 1
+					0,0,10000 // vertex 4
+				};
+
+				static const GLfloat color_buffer_data [] = {
+					0,1,1, // color 1
+					0,1,1, // color 2
+					0,1,1, // color 3
+
+					0,1,1, // color 3
+					0,1,1, // color 4
+					0,1,1  // color 1
+				};
+				static const GLfloat texture_buffer_data [] = {
+					0,1, // TexCoord 1 - bot left
+					1,0, // TexCoord 3 - top right
+					1,1, // TexCoord 2 - bot right
+
+					1,0, // TexCoord 3 - top right
+					0,1, // TexCoord 1 - bot left
+					0,0  // TexCoord 4 - top left
+				};
+				// create3DObject creates and returns a handle to a VAO that can be used later
+				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data ,texture, GL_FILL);
+			}
+
+			float camera_rotation_angle = 75;
+			float rectangle_rotation = 0;
+			float obstacle_rotation = 0;
+
+			/* Per-frame instance lists, filled while the board is walked and drawn together by drawScene */
+			struct SceneInstances {
+				vector<glm::vec4> pillars;  // cube and crate walls of every pillar
+				vector<glm::vec4> tops;     // textured top face of every pillar
+				vector<glm::vec4> enemyCentres; // one entry per enemy, expanded into 'enemies' once culled
+				vector<glm::vec4> enemies[ENEMY_LOD_LEVELS]; // one entry per swept copy of the enemy circle, per LOD
+				vector<glm::vec4> players;
+				vector<glm::vec4> water;
+				glm::vec3 eye; // camera position the frame's view was built from
+			} Scene;
+
+			/* Where each instance list of this frame landed in the upload ring (-1 when empty) */
+			struct SceneOffsets {
+				GLintptr pillars;
+				GLintptr tops;
+				GLintptr enemies[ENEMY_LOD_LEVELS];
+				GLintptr players;
+				GLintptr water;
+			};
+
+			/* Queue one pillar - the coloured cube and its textured faces - with its base at height 'base' and its top face at 'top' */
+			void drawTile (float x, float base, float z, float top)
+			{
+				Scene.pillars.push_back(glm::vec4(x, base, z, 0));
+				Scene.tops.push_back(glm::vec4(x, top, z, 0));
+			}
+
+			/* Dynamic resolution: the scene is drawn into the lower left 'scale' of an offscreen target the size of
+			 * the framebuffer, then stretched over the window before the HUD is drawn at native resolution.
+			 * Without --scene-scale the scale follows the GPU time of the scene pass toward the frame budget. */
+			#define SCENE_SCALE_MIN 0.5f
+			#define SCENE_SCALE_FRAMES 30      // frames averaged per adjustment, well past the GPU timer latency
+			#define SCENE_SCALE_HEADROOM 0.9   // aim under the budget so the HUD and the swap still fit
+			#define SCENE_SCALE_DEADBAND 0.05f // smaller corrections are ignored
+
+			struct DynamicResolution {
+				GLRenderTarget target;
+				float scale;     // fraction of the framebuffer width and height the scene is rendered at
+				int width;       // pixels rendered this frame
+				int height;
+				GLGpuTimer timer;
+				double gpuMs;    // summed over the current window
+				int frames;
+				int changes;
+			} SceneTarget;
+
+			/* Overdraw measurement: with --overdraw every fragment that passes the depth test while the scene is shaded
+			 * bumps the stencil of its pixel, and the stencil of the rendered area is summed once the scene is done.
+			 * Depth-only prepass fragments are not counted - they are what the prepass trades shading for */
+			struct OverdrawCounter {
+				vector<unsigned char> stencil;
+				vector<unsigned char> heat; // RGBA heat colours of the rendered area
+				double fragments; // summed over the current report window
+				double pixels;
+				int maximum;
+				double lastReport;
+			} Overdraw;
+
+			/* Read the stencil counts of the rendered area into Overdraw.stencil and return their sum */
+			long long readStencilCounts ()
+			{
+				glDisable(GL_STENCIL_TEST);
+				int pixels = SceneTarget.width*SceneTarget.height;
+				Overdraw.stencil.resize(pixels);
+				glPixelStorei(GL_PACK_ALIGNMENT, 1);
+				glReadPixels(0, 0, SceneTarget.width, SceneTarget.height, GL_STENCIL_INDEX, GL_UNSIGNED_BYTE, &Overdraw.stencil[0]);
+				glPixelStorei(GL_PACK_ALIGNMENT, 4);
+				long long fragments = 0;
+				for (int p=0; p<pixels; p++)
+					fragments += Overdraw.stencil[p];
+				return fragments;
+			}
+
+			void countOverdraw ()
+			{
+				Overdraw.fragments += readStencilCounts();
+				Overdraw.pixels += SceneTarget.width*SceneTarget.height;
+
+				if (glfwGetTime() - Overdraw.lastReport >= 1.0) {
+					cout << "OVERDRAW: " << Overdraw.fragments/Overdraw.pixels << " fragments shaded per pixel (culling " << (cullFaces ? "on" : "off") << ", prepass " << (depthPrepass ? "on" : "off") << ")" << endl;
+					Overdraw.fragments = Overdraw.pixels = 0;
+					Overdraw.lastReport = glfwGetTime();
+				}
+			}
+
+			/* Camera the main view is looking through, for reports */
+			const char* cameraName ()
+			{
+				if (heliview == 1)
+					return "helicopter";
+				if (advenview)
+					return "adventurer";
+				if (followview)
+					return "follow";
+				return eyey == 300 ? "top" : "tower";
+			}
+
+			/* Heatmap: with H the stencil counts every fragment rasterized into the scene target - including those
+			 * that fail the depth test, and the HUD drawn into the target for the occasion - and the picture is
+			 * replaced by the counts on a heat ramp before it is stretched over the window */
+			#define HEATMAP_SCALE 8 // fragments per pixel shown as white
+
+			void heatColor (int count, unsigned char* rgba)
+			{
+				// black, blue, cyan, green, yellow, red, white
+				static const float ramp[7][3] = { {0,0,0}, {0,0,1}, {0,1,1}, {0,1,0}, {1,1,0}, {1,0,0}, {1,1,1} };
+				float t = min(1.0f, (float)count / HEATMAP_SCALE) * 6;
+				int k = min(5, (int)t);
+				float f = t - k;
+				for (int c=0; c<3; c++)
+					rgba[c] = 255 * (ramp[k][c] + f*(ramp[k+1][c] - ramp[k][c]));
+				rgba[3] = 255;
+			}
+
+			/* Paint the counts over the rendered area of the scene colour texture */
+			void showHeatmap ()
+			{
+				long long fragments = readStencilCounts();
+				int pixels = SceneTarget.width*SceneTarget.height;
+				Overdraw.heat.resize(4*pixels);
+				int maximum = 0;
+				for (int p=0; p<pixels; p++) {
+					maximum = max(maximum, (int)Overdraw.stencil[p]);
+					heatColor(Overdraw.stencil[p], &Overdraw.heat[4*p]);
+				}
+				glBindTexture(GL_TEXTURE_2D, SceneTarget.target.ColorTextureID);
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SceneTarget.width, SceneTarget.height, GL_RGBA, GL_UNSIGNED_BYTE, &Overdraw.heat[0]);
+				glBindTexture(GL_TEXTURE_2D, 0);
+
+				Overdraw.fragments += fragments;
+				Overdraw.pixels += pixels;
+				Overdraw.maximum = max(Overdraw.maximum, maximum);
+				if (glfwGetTime() - Overdraw.lastReport >= 1.0) {
+					cout << "HEATMAP [" << cameraName() << "]: average " << Overdraw.fragments/Overdraw.pixels << ", max " << Overdraw.maximum << " fragments per pixel (culling " << (cullFaces ? "on" : "off") << ", prepass " << (depthPrepass ? "on" : "off") << ")" << endl;
+					Overdraw.fragments = Overdraw.pixels = 0;
+					Overdraw.maximum = 0;
+					Overdraw.lastReport = glfwGetTime();
+				}
+			}
+
+			/* Redirect the scene into the offscreen target at the current scale */
+			void beginSceneTarget ()
+			{
+				if (SceneTarget.target.width != screenWidth || SceneTarget.target.height != screenHeight) {
+					destroyRenderTarget(SceneTarget.target);
+					SceneTarget.target = createRenderTarget(screenWidth, screenHeight, "scene");
+				}
+				SceneTarget.width = max(1, (int)(screenWidth*SceneTarget.scale + 0.5f));
+				SceneTarget.height = max(1, (int)(screenHeight*SceneTarget.scale + 0.5f));
+
+				beginGpuTimer(SceneTarget.timer);
+				glBindFramebuffer(GL_FRAMEBUFFER, SceneTarget.target.FramebufferID);
+				glViewport(0, 0, SceneTarget.width, SceneTarget.height);
+				if (Options.overdraw || heatmap) {
+					glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+					glEnable(GL_STENCIL_TEST);
+					glStencilFunc(GL_ALWAYS, 0, 0xff);
+					glStencilOp(GL_KEEP, heatmap ? GL_INCR : GL_KEEP, GL_INCR);
+				}
+				else
+					glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			}
+
+			/* Average the scene's GPU time over a window and rescale toward the budget.
+			 * Fill cost goes with the area, so the side changes with the square root of the time ratio */
+			void updateSceneScale ()
+			{
+				if (Options.sceneScale > 0)
+					return;
+				SceneTarget.gpuMs += SceneTarget.timer.LastMs;
+				if (++SceneTarget.frames < SCENE_SCALE_FRAMES)
+					return;
+				double average = SceneTarget.gpuMs / SceneTarget.frames;
+				SceneTarget.gpuMs = 0;
+				SceneTarget.frames = 0;
+				if (average <= 0)
+					return;
+
+				float wanted = SceneTarget.scale * sqrt(Options.frameBudget * SCENE_SCALE_HEADROOM / average);
+				wanted = min(1.0f, max(SCENE_SCALE_MIN, wanted));
+				if (fabs(wanted - SceneTarget.scale) < SCENE_SCALE_DEADBAND)
+					return;
+				if (Options.stats)
+					cout << "SCENE SCALE: " << SceneTarget.scale << " -> " << wanted << " (scene " << average << " ms, budget " << Options.frameBudget << " ms)" << endl;
+				SceneTarget.scale = wanted;
+				SceneTarget.changes++;
+			}
+
+			/* Stretch the rendered part of the target over the window and go back to the default framebuffer */
+			void endSceneTarget ()
+			{
+				bool native = SceneTarget.width == screenWidth && SceneTarget.height == screenHeight;
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, SceneTarget.target.FramebufferID);
+				if (heatmap)
+					showHeatmap();
+				else if (Options.overdraw)
+					countOverdraw();
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+				glBlitFramebuffer(0, 0, SceneTarget.width, SceneTarget.height, 0, 0, screenWidth, screenHeight, GL_COLOR_BUFFER_BIT, native ? GL_NEAREST : GL_LINEAR);
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+				glViewport(0, 0, screenWidth, screenHeight);
+				endGpuTimer(SceneTarget.timer);
+				updateSceneScale();
+			}
+
+			/* Multi-view: the main camera fills the scene target and, with V, the fixed cameras are drawn as insets
+			 * along its bottom edge in the same frame */
+			enum CameraMode { CAMERA_MAIN, CAMERA_TOP, CAMERA_TOWER, CAMERA_FOLLOW, CAMERA_ADVENTURER, SCENE_VIEWS };
+
+			struct SceneView {
+				const char* name;
+				float x, y, size;  // viewport as fractions of the rendered scene, square in those units so the aspect matches
+				int height;        // pixels the view is drawn at, for the enemy LOD
+				vector<int> lod;   // current LOD of the enemy on each board cell, per view for the hysteresis
+				GLGpuTimer timer;
+				double cpuMs;      // summed since the last --stats report
+				double gpuMs;
+				int frames;
+			};
+
+			#define VIEW_INSET_SIZE 0.22f
+			#define VIEW_INSET_GAP 0.024f
+			SceneView sceneViews[SCENE_VIEWS] = {
+				{ "main", 0, 0, 1, 0, vector<int>(100, -1) },
+				{ "top", VIEW_INSET_GAP, VIEW_INSET_GAP, VIEW_INSET_SIZE, 0, vector<int>(100, -1) },
+				{ "tower", 2*VIEW_INSET_GAP + VIEW_INSET_SIZE, VIEW_INSET_GAP, VIEW_INSET_SIZE, 0, vector<int>(100, -1) },
+				{ "follow", 3*VIEW_INSET_GAP + 2*VIEW_INSET_SIZE, VIEW_INSET_GAP, VIEW_INSET_SIZE, 0, vector<int>(100, -1) },
+				{ "adventurer", 4*VIEW_INSET_GAP + 3*VIEW_INSET_SIZE, VIEW_INSET_GAP, VIEW_INSET_SIZE, 0, vector<int>(100, -1) },
+			};
+			SceneView* currentView = &sceneViews[CAMERA_MAIN]; // view being drawn
+
+			/* Pick the circle LOD for the enemy at (x, y, z) from its projected diameter in pixels.
+			 * Refining happens at once; coarsening waits until the size is well inside the coarser level */
+			int selectEnemyLod (float x, float y, float z)
+			{
+				int cell = glm::clamp((int)(z/30), 0, 9)*10 + glm::clamp((int)(x/30), 0, 9);
+				int& level = currentView->lod[cell];
+
+				float depth = -(FrameData.data.view * glm::vec4(x, y, z, 1)).z;
+				if (depth <= 0.1f)
+					return level = ENEMY_LOD_LEVELS-1;
+				float diameter = 2*obstacle.rad * FrameData.data.projection[1][1] * currentView->height/2 / depth;
+				float wanted = M_PI*diameter / ENEMY_LOD_PIXELS_PER_SEGMENT;
+
+				int target = ENEMY_LOD_LEVELS-1;
+				for (int l=0; l<ENEMY_LOD_LEVELS; l++) {
+					if (enemyLodSegments[l] >= wanted) {
+						target = l;
+						break;
+					}
+				}
+				if (level < 0 || target > level)
+					level = target;
+				else {
+					// Drop only as far as the hysteresis margin holds for the level landed on, so a jump of
+					// several levels (a camera switch) still gets the margin at its final boundary
+					while (level > target && wanted*ENEMY_LOD_HYSTERESIS <= enemyLodSegments[level-1])
+						level--;
+				}
+				return level;
+			}
+
+			/* Queue one enemy - the circle swept a full turn about +Y - centred at (x, y, z) */
+			void drawEnemy (float x, float y, float z)
+			{
+				Scene.enemyCentres.push_back(glm::vec4(x, y, z, 0));
+			}
+
+			/* Turn the surviving enemy centres into swept circle copies at their LOD.
+			 * Coarser LODs also sweep in coarser steps, so both directions of the ball lose detail together */
+			void expandEnemies ()
+			{
+				for (size_t e=0; e<Scene.enemyCentres.size(); e++) {
+					glm::vec4 c = Scene.enemyCentres[e];
+					int level = selectEnemyLod(c.x, c.y, c.z);
+					int segments = enemyLodSegments[level];
+					for(int k=0;k<=segments;k++)
+						Scene.enemies[level].push_back(glm::vec4(c.x, c.y, c.z, (float)(k*(360.0f/segments)*M_PI/180.0f)));
+
+					int full = ENEMY_LOD_FULL_SEGMENTS;
+					Stats.enemyTriangles += (segments+1)*(segments-2);
+					Stats.enemyTrianglesSaved += (full+1)*(full-2) - (segments+1)*(segments-2);
+					Stats.enemyLevels[level]++;
+				}
+			}
+
+			/* CPU occlusion culling for the pillar field.
+			 * Pillars sit on the 10x10 board grid, so runs of pillars with the same base along a row or a column
+			 * are solid boxes. The region hidden behind a convex box is itself convex, so a target is hidden
+			 * when the segments from the eye to all eight corners of its bounds cross the same occluder. */
+			#define PILLAR_SIZE 30.0f
+			#define PILLAR_HEIGHT 100.0f
+			#define OCCLUDER_INSET 0.01f // shrink occluders so touching neighbours never count as covered
+			#define OCCLUDER_EYE_MARGIN 1.0f // an eye this close to an occluder counts as inside it
+
+			struct SceneBox {
+				float min[3];
+				float max[3];
+			};
+
+			vector<SceneBox> occluders;
+
+			SceneBox makeSceneBox (float x0, float y0, float z0, float x1, float y1, float z1)
+			{
+				SceneBox box = { { x0, y0, z0 }, { x1, y1, z1 } };
+				return box;
+			}
+
+			/* Does the segment from 'from' to 'to' pass through 'box' (slab test) */
+			bool segmentHitsBox (const float from[3], const float to[3], const SceneBox& box)
+			{
+				float t0 = 0, t1 = 1;
+				for (int k=0; k<3; k++) {
+					float d = to[k] - from[k];
+					if (fabs(d) < 1e-6f) {
+						if (from[k] < box.min[k] || from[k] > box.max[k])
+							return false;
+						continue;
+					}
+					float a = (box.min[k] - from[k]) / d;
+					float b = (box.max[k] - from[k]) / d;
+					if (a > b)
+						swap(a, b);
+					t0 = max(t0, a);
+					t1 = min(t1, b);
+					if (t0 > t1)
+						return false;
+				}
+				return true;
+			}
+
+			bool boxesOverlap (const SceneBox& a, const SceneBox& b)
+			{
+				for (int k=0; k<3; k++)
+					if (a.max[k] < b.min[k] || b.max[k] < a.min[k])
+						return false;
+				return true;
+			}
+
+			bool boxContains (const SceneBox& box, const float point[3], float margin)
+			{
+				for (int k=0; k<3; k++)
+					if (point[k] < box.min[k] - margin || point[k] > box.max[k] + margin)
+						return false;
+				return true;
+			}
+
+			bool boxOccluded (const SceneBox& target)
+			{
+				float eye[3] = { Scene.eye.x, Scene.eye.y, Scene.eye.z };
+				for (size_t o=0; o<occluders.size(); o++) {
+					const SceneBox& occluder = occluders[o];
+					// A run that contains the target cannot hide it
+					if (boxesOverlap(occluder, target))
+						continue;
+					// Nor can one the eye is in (a follow camera inside a pillar) - every segment would start in it
+					if (boxContains(occluder, eye, OCCLUDER_EYE_MARGIN))
+						continue;
+					bool hidden = true;
+					for (int c=0; c<8 && hidden; c++) {
+						float corner[3] = {
+							(c & 1) ? target.max[0] : target.min[0],
+							(c & 2) ? target.max[1] : target.min[1],
+							(c & 4) ? target.max[2] : target.min[2]
+						};
+						hidden = segmentHitsBox(eye, corner, occluder);
+					}
+					if (hidden)
+						return true;
+				}
+				return false;
+			}
+
+			/* Merge the queued pillars into row and column runs */
+			void buildOccluders ()
+			{
+				int grid[10][10];
+				memset(grid, -1, sizeof(grid));
+				for (size_t p=0; p<Scene.pillars.size(); p++) {
+					glm::vec4 pillar = Scene.pillars[p];
+					int i = (int)floor(pillar.z/PILLAR_SIZE + 0.5f), j = (int)floor(pillar.x/PILLAR_SIZE + 0.5f);
+					if (i < 0 || i > 9 || j < 0 || j > 9 || grid[i][j] >= 0)
+						continue;
+					if (fabs(pillar.x - j*PILLAR_SIZE) > OCCLUDER_INSET || fabs(pillar.z - i*PILLAR_SIZE) > OCCLUDER_INSET)
+						continue;
+					grid[i][j] = p;
+				}
+
+				occluders.clear();
+				for (int pass=0; pass<2; pass++) {
+					// pass 0 walks rows (runs along x), pass 1 walks columns (runs along z)
+					for (int line=0; line<10; line++) {
+						int start = 0;
+						while (start < 10) {
+							int first = pass ? grid[start][line] : grid[line][start];
+							if (first < 0) {
+								start++;
+								continue;
+							}
+							float base = Scene.pillars[first].y;
+							int end = start+1;
+							while (end < 10) {
+								int next = pass ? grid[end][line] : grid[line][end];
+								if (next < 0 || Scene.pillars[next].y != base)
+									break;
+								end++;
+							}
+							// Single pillars are already covered by the row pass
+							if (pass == 0 || end - start > 1) {
+								float x0 = (pass ? line : start)*PILLAR_SIZE, x1 = (pass ? line+1 : end)*PILLAR_SIZE;
+								float z0 = (pass ? start : line)*PILLAR_SIZE, z1 = (pass ? end : line+1)*PILLAR_SIZE;
+								occluders.push_back(makeSceneBox(x0 + OCCLUDER_INSET, base + OCCLUDER_INSET, z0 + OCCLUDER_INSET,
+								                                 x1 - OCCLUDER_INSET, base + PILLAR_HEIGHT - OCCLUDER_INSET, z1 - OCCLUDER_INSET));
+							}
+							start = end;
+						}
+					}
+				}
+			}
+
+			/* Drop queued pillars and enemies that are hidden behind the pillar field from Scene.eye, call buildOccluders first */
+			void cullScene ()
+			{
+				TraceScope trace("cullScene");
+
+				size_t kept = 0;
+				for (size_t p=0; p<Scene.pillars.size(); p++) {
+					glm::vec4 pillar = Scene.pillars[p], top = Scene.tops[p];
+					SceneBox bounds = makeSceneBox(pillar.x, pillar.y, pillar.z,
+					                               pillar.x + PILLAR_SIZE, max(pillar.y + PILLAR_HEIGHT, top.y), pillar.z + PILLAR_SIZE);
+					if (boxOccluded(bounds)) {
+						Stats.pillarsCulled++;
+						continue;
+					}
+					Scene.pillars[kept] = pillar;
+					Scene.tops[kept] = top;
+					kept++;
+				}
+				Scene.pillars.resize(kept);
+				Scene.tops.resize(kept);
+
+				// The circle's vertices sit at z=1, so sweeping it about +Y reaches out to sqrt(rad^2 + 1)
+				kept = 0;
+				float rad = sqrtf(obstacle.rad*obstacle.rad + 1);
+				for (size_t e=0; e<Scene.enemyCentres.size(); e++) {
+					glm::vec4 c = Scene.enemyCentres[e];
+					if (boxOccluded(makeSceneBox(c.x - rad, c.y - rad, c.z - rad, c.x + rad, c.y + rad, c.z + rad))) {
+						Stats.enemiesCulled++;
+						continue;
+					}
+					Scene.enemyCentres[kept++] = c;
+				}
+				Scene.enemyCentres.resize(kept);
+			}
+
+			/* Stream an instance list through the upload ring, returns its offset or -1 when there is nothing to draw */
+			GLintptr uploadInstances (const vector<glm::vec4>& instances)
+			{
+				if (instances.empty())
+					return -1;
+				return uploadRingWrite(&instances[0], instances.size()*sizeof(glm::vec4), sizeof(glm::vec4));
+			}
+
+			/* GL 4.3 path: one glMultiDrawElementsIndirect per program/texture state over the mesh arena.
+			 * Instance lists were streamed back to back, so each command's baseInstance indexes them from 'base'. */
+			struct DrawElementsIndirectCommand {
+				GLuint count;
+				GLuint instanceCount;
+				GLuint firstIndex;
+				GLint baseVertex;
+				GLuint baseInstance;
+			};
+
+			int sceneDrawCalls = 0;
+			int scenePrograms = 0;
+
+			void addIndirectCommand (vector<DrawElementsIndirectCommand>& commands, struct VAO* vao, GLintptr instances, GLintptr base, int count)
+			{
+				if (instances < 0)
+					return;
+				DrawElementsIndirectCommand command;
+				command.count = vao->ArenaIndexCount;
+				command.instanceCount = count;
+				command.firstIndex = vao->ArenaFirstIndex;
+				command.baseVertex = vao->ArenaBaseVertex;
+				command.baseInstance = (instances - base) / sizeof(glm::vec4);
+				commands.push_back(command);
+			}
+
+			void drawSceneIndirect (const SceneOffsets& offsets)
+			{
+				// Lists are streamed in order, so the first non-empty one is the base for every command
+				GLintptr base = -1;
+				const GLintptr* all = &offsets.pillars;
+				for (size_t k=0; k<sizeof(SceneOffsets)/sizeof(GLintptr); k++)
+					if (all[k] >= 0 && (base < 0 || all[k] < base))
+						base = all[k];
+				if (base < 0)
+					return;
+				// The direct state access arena reads the offsets from the start of the ring instead
+				GLintptr bound = base;
+				if (dsaPath)
+					base = 0;
+
+				vector<DrawElementsIndirectCommand> commands;
+				addIndirectCommand(commands, cube, offsets.pillars, base, Scene.pillars.size());
+				for (int l=0; l<ENEMY_LOD_LEVELS; l++)
+					addIndirectCommand(commands, obstacleLod[l], offsets.enemies[l], base, Scene.enemies[l].size());
+				addIndirectCommand(commands, cubetest, offsets.players, base, Scene.players.size());
+				int colored = commands.size();
+				addIndirectCommand(commands, back, offsets.water, base, Scene.water.size());
+				addIndirectCommand(commands, rect1, offsets.pillars, base, Scene.pillars.size());
+				addIndirectCommand(commands, rect2, offsets.pillars, base, Scene.pillars.size());
+				addIndirectCommand(commands, rect3, offsets.pillars, base, Scene.pillars.size());
+				addIndirectCommand(commands, rect4, offsets.pillars, base, Scene.pillars.size());
+				addIndirectCommand(commands, rect6, offsets.tops, base, Scene.tops.size());
+
+				GLintptr offset = uploadRingWrite(&commands[0], commands.size()*sizeof(DrawElementsIndirectCommand), sizeof(DrawElementsIndirectCommand));
+				if (offset < 0)
+					return;
+
+				glPolygonMode (GL_FRONT_AND_BACK, GL_FILL);
+				glBindVertexArray(Arena.VertexArrayID);
+				if (!dsaPath)
+					bindInstanceOffsets(bound);
+				glBindBuffer(GL_DRAW_INDIRECT_BUFFER, UploadRing.Buffer);
+
+				// Textured faces go after the cubes so they win the depth tie on the shared planes - commands
+				// run in order, so the uber shader draws the whole board in one call
+				const DrawElementsIndirectCommand* first = (const DrawElementsIndirectCommand*) offset;
+				if (uberShader) {
+					glUseProgram(sceneProgramID);
+					glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, first, commands.size(), 0);
+					sceneDrawCalls = scenePrograms = 1;
+				}
+				else {
+					// Every material is a layer of the bound array, so the textured faces still go in one call
+					glUseProgram(programID);
+					glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, first, colored, 0);
+					glUseProgram(textureProgramID);
+					glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, first + colored, commands.size() - colored, 0);
+					sceneDrawCalls = scenePrograms = 2;
+				}
+				glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+			}
+
+			/* GL 3.3 path: one instanced call per mesh */
+			void drawSceneInstanced (const SceneOffsets& offsets)
+			{
+				sceneDrawCalls = 0;
+				// The colored meshes have no texcoord attribute, so the uber shader reads their layer
+				// from the attribute's current value
+				if (uberShader) {
+					glUseProgram(sceneProgramID);
+					glVertexAttrib3f(2, 0, 0, MATERIAL_VERTEX_COLOR);
+					scenePrograms = 1;
+				}
+				else {
+					glUseProgram (programID);
+					scenePrograms = 2;
+				}
+				if (offsets.pillars >= 0) {
+					draw3DObject(cube, offsets.pillars, Scene.pillars.size());
+					sceneDrawCalls++;
+				}
+				for (int l=0; l<ENEMY_LOD_LEVELS; l++)
+					if (offsets.enemies[l] >= 0) {
+						draw3DObject(obstacleLod[l], offsets.enemies[l], Scene.enemies[l].size());
+						sceneDrawCalls++;
+					}
+				if (offsets.players >= 0) {
+					draw3DObject(cubetest, offsets.players, Scene.players.size());
+					sceneDrawCalls++;
+				}
+
+				// Textured faces go after the cubes so they win the depth tie on the shared planes
+				if (!uberShader)
+					glUseProgram(textureProgramID);
+				if (offsets.water >= 0) {
+					draw3DTexturedObject(back, offsets.water, Scene.water.size());
+					sceneDrawCalls++;
+				}
+				if (offsets.pillars >= 0) {
+					draw3DTexturedObject(rect1, offsets.pillars, Scene.pillars.size());
+					draw3DTexturedObject(rect2, offsets.pillars, Scene.pillars.size());
+					draw3DTexturedObject(rect3, offsets.pillars, Scene.pillars.size());
+					draw3DTexturedObject(rect4, offsets.pillars, Scene.pillars.size());
+					sceneDrawCalls += 4;
+				}
+				if (offsets.tops >= 0) {
+					draw3DTexturedObject(rect6, offsets.tops, Scene.tops.size());
+					sceneDrawCalls++;
+				}
+			}
+
+			void drawScenePass (const SceneOffsets& offsets)
+			{
+				if (scenePath == SCENE_PATH_INDIRECT)
+					drawSceneIndirect(offsets);
+				else
+					drawSceneInstanced(offsets);
+			}
+
+			/* Eye and target of the fixed cameras, as the keys selecting them set them up */
+			void cameraView (int camera, glm::vec3& eye, glm::vec3& target)
+			{
+				switch (camera) {
+					case CAMERA_TOP: // U
+						eye = glm::vec3(149.999, 300, 150);
+						target = glm::vec3(150, 0, 150);
+						break;
+					case CAMERA_TOWER: // T
+						eye = glm::vec3(-25, 270, 386.3);
+						target = glm::vec3(300, 0, 150);
+						break;
+					case CAMERA_FOLLOW: // B, behind the player before it is turned
+						eye = glm::vec3(user.x+7.5, user.y+35, user.z-7.5);
+						target = glm::vec3(user.x+7.5, user.y+25, user.z);
+						break;
+					case CAMERA_ADVENTURER: // A, from the player's eyes before it is turned
+						eye = glm::vec3(user.x+7.5, user.y+30, user.z+13);
+						target = glm::vec3(user.x+7.5, user.y+20, user.z+30);
+						break;
+				}
+			}
+
+			/* Cull, pick LODs for and draw the queued lists for currentView, from the camera in FrameData and Scene.eye.
+			 * Lists culling shrinks are restored afterwards when 'keepLists' is set, so the next view starts from the whole frame again */
+			void drawViewLists (const SceneOffsets& shared, bool keepLists)
+			{
+				vector<glm::vec4> pillars, tops, enemyCentres;
+				if (keepLists) {
+					pillars = Scene.pillars;
+					tops = Scene.tops;
+					enemyCentres = Scene.enemyCentres;
+				}
+				if (Options.occlusion)
+					cullScene();
+				expandEnemies();
+
+				SceneOffsets offsets = shared;
+				offsets.pillars = uploadInstances(Scene.pillars);
+				offsets.tops = uploadInstances(Scene.tops);
+				for (int l=0; l<ENEMY_LOD_LEVELS; l++)
+					offsets.enemies[l] = uploadInstances(Scene.enemies[l]);
+
+				// The prepass runs the same draws with colour and stencil writes off; the shading pass then only
+				// passes GL_LEQUAL on the nearest surface of each pixel and leaves the depth as it is
+				if (depthPrepass) {
+					glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+					glStencilMask(0);
+					drawScenePass(offsets);
+					glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+					glStencilMask(0xff);
+					glDepthMask(GL_FALSE);
+				}
+				drawScenePass(offsets);
+				if (depthPrepass)
+					glDepthMask(GL_TRUE);
+
+				for (int l=0; l<ENEMY_LOD_LEVELS; l++)
+					Scene.enemies[l].clear();
+				if (keepLists) {
+					Scene.pillars.swap(pillars);
+					Scene.tops.swap(tops);
+					Scene.enemyCentres.swap(enemyCentres);
+				}
+			}
+
+			/* Draw the queued lists from one camera into its part of the scene target */
+			void drawSceneView (int camera, const SceneOffsets& shared, bool keepLists)
+			{
+				SceneView& view = sceneViews[camera];
+				TraceScope trace("drawSceneView", view.name);
+				double cpuStart = glfwGetTime();
+				if (multiView)
+					beginGpuTimer(view.timer);
+				view.height = view.size*SceneTarget.height;
+				currentView = &view;
+
+				// The main camera was set up by draw()
+				if (camera != CAMERA_MAIN) {
+					glm::vec3 eye, target;
+					cameraView(camera, eye, target);
+					FrameData.data.view = glm::lookAt(eye, target, glm::vec3(0, 1, 0));
+					FrameData.data.VP = FrameData.data.projection * FrameData.data.view;
+					uploadFrameData();
+					Scene.eye = eye;
+
+					// Inset with a thin dark frame
+					int x = view.x*SceneTarget.width, y = view.y*SceneTarget.height;
+					int width = view.size*SceneTarget.width, height = view.size*SceneTarget.height;
+					glEnable(GL_SCISSOR_TEST);
+					glScissor(x-2, y-2, width+4, height+4);
+					glClearColor(0.2, 0.2, 0.2, 1);
+					glClear(GL_COLOR_BUFFER_BIT);
+					glScissor(x, y, width, height);
+					glClearColor(1, 1, 1, 1);
+					glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+					glDisable(GL_SCISSOR_TEST);
+					glViewport(x, y, width, height);
+				}
 
-					0.347f,  0.257f,  0.137f,
+				drawViewLists(shared, keepLists);
 
+				if (multiView) {
+					endGpuTimer(view.timer);
+					view.gpuMs += view.timer.LastMs;
+					view.cpuMs += (glfwGetTime() - cpuStart) * 1000;
+					view.frames++;
+				}
+			}
 
-				};
+			/* Per view cost since the last report - the insets are what multi-view adds on top of the main view */
+			void reportViewCosts ()
+			{
+				if (!sceneViews[CAMERA_MAIN].frames)
+					return;
+				cout << "VIEW COST:";
+				for (int v=0; v<SCENE_VIEWS; v++) {
+					SceneView& view = sceneViews[v];
+					int frames = max(view.frames, 1);
+					cout << (v ? ", " : " ") << view.name << (v ? " +" : " ") << view.cpuMs/frames << " ms cpu" << (v ? " +" : " ") << view.gpuMs/frames << " ms gpu";
+					view.cpuMs = view.gpuMs = 0;
+					view.frames = 0;
+				}
+				cout << endl;
+			}
 
-				// Texture coordinates start with (0,0) at top left of the image to (1,1) at bot right
-				static const GLfloat texture_buffer_data [] = {
-					0,1, // TexCoord 1 - bot left
-					1,1, // TexCoord 2 - bot right
-					1,0, // TexCoord 3 - top right
+			/* Minimap: the board from above, rendered into a small target of its own only when the grid, the enemies
+			 * or the player's cell change - and then no more often than MINIMAP_MIN_INTERVAL - or when it is
+			 * MINIMAP_MAX_AGE old, for the moving pillars. Every frame it costs one textured quad in the HUD corner. */
+			#define MINIMAP_SIZE 192          // pixels, rendered and shown 1:1
+			#define MINIMAP_MARGIN 16         // pixels from the top left corner of the window
+			#define MINIMAP_EXTENT 165.0f     // half the side of the area shown at the pillar tops, the board is 300 across
+			#define MINIMAP_MIN_INTERVAL 0.25 // seconds
+			#define MINIMAP_MAX_AGE 1.0
+
+			struct MinimapState {
+				GLRenderTarget target;
+				GLuint programID;
+				GLint rectID;
+				GLuint VertexArrayID; // the quad corners come from gl_VertexID, but core profile needs a bound VAO
+				VertexArrayHandle VertexArray;
+				SceneView view;
+				unsigned signature;   // board state the texture shows
+				double lastRefresh;
+				int refreshes;
+			} Minimap;
+
+			void setupMinimapProgram (GLuint program)
+			{
+				glUseProgram(program);
+				glUniform1i(glGetUniformLocation(program, "minimap"), 0);
+				Minimap.rectID = glGetUniformLocation(program, "rect");
+			}
 
-					1,0, // TexCoord 3 - top right
-					0,0, // TexCoord 4 - top left
-					0,1  // TexCoord 1 - bot left
-				};
+			void initMinimap ()
+			{
+				Minimap.target = createRenderTarget(MINIMAP_SIZE, MINIMAP_SIZE, "minimap");
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+				Minimap.VertexArray = createVertexArray(MEMORY_TARGETS, "minimap");
+				Minimap.VertexArrayID = resourceName(Minimap.VertexArray);
+				SceneView view = { "minimap", 0, 0, 1, MINIMAP_SIZE, vector<int>(100, -1) };
+				Minimap.view = view;
+				getProgram( "minimap.vert", "minimap.frag", Minimap.programID, setupMinimapProgram );
+			}
 
-				// create3DTexturedObject creates and returns a handle to a VAO that can be used later
-				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, textureID, GL_FILL);
+			void destroyMinimap ()
+			{
+				destroyRenderTarget(Minimap.target);
+				releaseResource(Minimap.VertexArray);
+				Minimap.VertexArrayID = 0;
 			}
 
-			VAO* createRectangleBack (GLuint textureID)
+			/* Hash of what the minimap shows: the holes and moving pillars, the enemies, the player's cell and the level */
+			unsigned minimapSignature ()
 			{
-				// GL3 accepts only Triangles. Quads are not supported
-				static const GLfloat vertex_buffer_data [] = {
-					x,0,z,
-					x,0,0,
-					x,y,0,
+				unsigned hash = 2166136261u; // FNV-1a
+				for (int i=0; i<10; i++)
+					for (int j=0; j<10; j++)
+						hash = (hash ^ (a[i][j]*4 + b[i][j])) * 16777619u;
+				int extra[3] = { user.i, user.j, count };
+				for (int e=0; e<3; e++)
+					hash = (hash ^ (unsigned) extra[e]) * 16777619u;
+				return hash;
+			}
 
-					x,y,0,
-					x,y,z,
-					x,0,z
-				};
+			/* Whether the minimap should be rendered again this frame */
+			bool minimapDue ()
+			{
+				if (!minimap || !Minimap.programID)
+					return false;
+				double age = glfwGetTime() - Minimap.lastRefresh;
+				if (Minimap.refreshes && age < MINIMAP_MIN_INTERVAL)
+					return false;
+				unsigned signature = minimapSignature();
+				if (Minimap.refreshes && signature == Minimap.signature && age < MINIMAP_MAX_AGE)
+					return false;
+				Minimap.signature = signature;
+				return true;
+			}
 
-				static const GLfloat color_buffer_data [] = {
-					0.655f,  0.653f,  0.042f,
+			/* Render the queued lists from the top camera into the minimap target, with the field of view narrowed to the board.
+			 * Not orthographic - the enemy circles stand on edge, so straight down they would have no area */
+			void drawMinimap (const SceneOffsets& shared)
+			{
+				TraceScope trace("drawMinimap");
+				glBindFramebuffer(GL_FRAMEBUFFER, Minimap.target.FramebufferID);
+				glViewport(0, 0, MINIMAP_SIZE, MINIMAP_SIZE);
+				glClearColor(1, 1, 1, 1);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+				glm::vec3 eye, target;
+				cameraView(CAMERA_TOP, eye, target);
+				FrameData.data.view = glm::lookAt(eye, target, glm::vec3(0, 1, 0));
+				FrameData.data.projection = glm::perspective(2*atanf(MINIMAP_EXTENT/(eye.y - PILLAR_HEIGHT)), 1.0f, 0.1f, 500.0f);
+				FrameData.data.VP = FrameData.data.projection * FrameData.data.view;
+				uploadFrameData();
+				Scene.eye = eye;
+				currentView = &Minimap.view;
+				drawViewLists(shared, false);
+
+				glBindFramebuffer(GL_FRAMEBUFFER, SceneTarget.target.FramebufferID);
+				Minimap.lastRefresh = glfwGetTime();
+				Minimap.refreshes++;
+				Stats.minimapRefreshes++;
+			}
 
-					0.714f,  0.505f,  0.345f,
+			/* Draw the last minimap render as one quad in the top left corner of the window */
+			void compositeMinimap ()
+			{
+				if (!minimap || !Minimap.refreshes)
+					return;
+				float width = 2.0f*MINIMAP_SIZE/screenWidth, height = 2.0f*MINIMAP_SIZE/screenHeight;
+				float left = -1 + 2.0f*MINIMAP_MARGIN/screenWidth, top = 1 - 2.0f*MINIMAP_MARGIN/screenHeight;
+				glUseProgram(Minimap.programID);
+				glUniform4f(Minimap.rectID, left, top - height, left + width, top);
+				glBindVertexArray(Minimap.VertexArrayID);
+				glBindTexture(GL_TEXTURE_2D, Minimap.target.ColorTextureID);
+				glDisable(GL_DEPTH_TEST);
+				glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+				glEnable(GL_DEPTH_TEST);
+				glBindTexture(GL_TEXTURE_2D, 0);
+			}
 
-					0.393f,  0.621f,  0.862f,
+			GLGpuTimer sceneTimer;
 
-					0.673f,  0.211f,  0.457f,
+			/* Draw everything queued this frame through the active scene path, from every active view, then empty the lists */
+			void drawScene ()
+			{
+				TraceScope trace("drawScene");
+				double cpuStart = glfwGetTime();
+				if (Options.benchScene)
+					beginGpuTimer(sceneTimer);
+
+				// Every scene mesh is wound counter-clockwise seen from outside
+				if (cullFaces)
+					glEnable(GL_CULL_FACE);
+				// The only texture bind of the scene
+				glBindTexture(GL_TEXTURE_2D_ARRAY, Materials.TextureID);
+
+				// Views share the queued lists, the occluders built from them, and the uploads culling does not change
+				if (Options.occlusion)
+					buildOccluders();
+				SceneOffsets shared;
+				shared.players = uploadInstances(Scene.players);
+				shared.water = uploadInstances(Scene.water);
+
+				bool refreshMinimap = minimapDue();
+				int views = multiView ? SCENE_VIEWS : 1;
+				for (int v=0; v<views; v++)
+					drawSceneView(v, shared, v+1 < views || refreshMinimap);
+				if (refreshMinimap)
+					drawMinimap(shared);
+				currentView = &sceneViews[CAMERA_MAIN];
+				glDisable(GL_CULL_FACE);
+				glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+				Scene.pillars.clear();
+				Scene.tops.clear();
+				Scene.enemyCentres.clear();
+				for (int l=0; l<ENEMY_LOD_LEVELS; l++)
+					Scene.enemies[l].clear();
+				Scene.players.clear();
+				Scene.water.clear();
+
+				if (Options.benchScene) {
+					// Average both paths over a fixed number of frames so they can be compared run against run
+					static double cpuTotal = 0, gpuTotal = 0;
+					static int frames = 0, generation = 0, mode = -1;
+					endGpuTimer(sceneTimer);
+					// Start over when a reloaded shader is swapped in, or I or G switch the path or the programs,
+					// so the averages are for what is drawing now only
+					int current = scenePath*2 + uberShader;
+					if (generation != shaderGeneration || mode != current) {
+						cpuTotal = gpuTotal = 0;
+						frames = 0;
+						generation = shaderGeneration;
+						mode = current;
+					}
+					cpuTotal += (glfwGetTime() - cpuStart) * 1000;
+					gpuTotal += sceneTimer.LastMs;
+					if (++frames == 300) {
+						cout << "SCENE [" << (scenePath == SCENE_PATH_INDIRECT ? "indirect" : "instanced") << ", " << (uberShader ? "uber" : "split") << " shader" << (dsaPath ? ", dsa" : "") << "]: cpu " << cpuTotal/frames << " ms, gpu " << gpuTotal/frames << " ms, " << sceneDrawCalls << " draw calls, " << scenePrograms << " programs" << endl;
+						cpuTotal = gpuTotal = 0;
+						frames = 0;
+					}
+				}
 
-					0.520f,  0.583f,  0.171f,
+				Stats.frames++;
+				if (Options.stats && glfwGetTime() - Stats.lastReport >= 1.0) {
+					cout << "STATS: " << Stats.frames << " frames, enemy triangles " << Stats.enemyTriangles/Stats.frames << "/frame (" << Stats.enemyTrianglesSaved/Stats.frames << " saved), LOD";
+					for (int l=0; l<ENEMY_LOD_LEVELS; l++)
+						cout << " " << enemyLodSegments[l] << ":" << Stats.enemyLevels[l]/Stats.frames;
+					cout << ", culled " << Stats.pillarsCulled/Stats.frames << " pillars " << Stats.enemiesCulled/Stats.frames << " enemies/frame";
+					cout << ", hud rebuilds " << Stats.hudRebuilds << ", minimap refreshes " << Stats.minimapRefreshes << ", ring stalls " << UploadRing.Stalls << ", scene scale " << SceneTarget.scale << endl;
+					reportResources("stats");
+					reportViewCosts();
+					memset(&Stats, 0, sizeof(Stats));
+					Stats.lastReport = glfwGetTime();
+				}
+			}
 
-					0.982f,  0.099f,  0.879f
-				};
+			/* Start a run of HUD strings in 'color' */
+			void beginText (glm::vec3 color)
+			{
+				if (textRenderer == TEXT_ATLAS)
+					TextAtlas.color = color;
+				else {
+					glUseProgram(fontProgramID);
+					glUniform3fv(GL3Font.fontColorID, 1, &color[0]);
+				}
+			}
 
-				// Texture coordinates start with (0,0) at top left of the image to (1,1) at bot right
-				static const GLfloat texture_buffer_data [] = {
-					0,1, // TexCoord 1 - bot left
-					1,1, // TexCoord 2 - bot right
-					1,0, // TexCoord 3 - top right
+			/* Render a string on the HUD plane at (x, y), between beginText and endText */
+			void drawText (float x, float y, const char* text)
+			{
+				if (textRenderer == TEXT_ATLAS)
+					queueAtlasText(x, y, text);
+				else {
+					glUniform4f(GL3Font.fontOffsetID, x, y, 0, 0);
+					GL3Font.font->Render(text);
+				}
+			}
 
-					1,0, // TexCoord 3 - top right
-					0,0, // TexCoord 4 - top left
-					0,1  // TexCoord 1 - bot left
-				};
+			/* Draw whatever the atlas renderer queued since beginText */
+			void endText ()
+			{
+				if (textRenderer == TEXT_ATLAS)
+					flushAtlasText();
+			}
 
-				// create3DTexturedObject creates and returns a handle to a VAO that can be used later
-				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, textureID, GL_FILL);
+			/* Retained HUD: the level, lives and score strings, and with the atlas renderer their quads in a buffer
+			 * of their own, are only rebuilt when one of the values or the colour changes */
+			struct HudLayer {
+				int level;       // values the cached strings show, -1 before the first frame
+				int lives;
+				int score;
+				glm::vec3 color;
+				char levelText[12];
+				char livesText[12];
+				char scoreText[12];
+				GLuint Buffer;   // atlas quads of every element
+				BufferHandle Handle;
+				GLsizei count;   // vertices in Buffer
+				int renderer;    // textRenderer the cache was built for
+			} Hud = { -1, -1, -1 };
+
+			void drawHudStrings ()
+			{
+				drawText(4, 4, "LEVEL : ");
+				drawText(6.5, 4, Hud.levelText);
+				drawText(4, 3, "LIFES : ");
+				drawText(6.5, 3, Hud.livesText);
+				drawText(4, 2, "SCORE : ");
+				drawText(6.5, 2, Hud.scoreText);
 			}
 
-			VAO* createRectangle (GLuint textureID)
+			void drawHud (glm::vec3 color)
 			{
-				// GL3 accepts only Triangles. Quads are not supported
-				static const GLfloat vertex_buffer_data [] = {
-					0,0,0, // vertex 1
-					10000,0,0, // vertex 2
-					10000,0,10000, // vertex 3
+				int level = count+1, lives = 10-lifes;
+				bool changed = level != Hud.level || lives != Hud.lives || score != Hud.score || Hud.renderer != textRenderer ||
+				               color.x != Hud.color.x || color.y != Hud.color.y || color.z != Hud.color.z;
+				if (changed) {
+					Hud.level = level;
+					Hud.lives = lives;
+					Hud.score = score;
+					Hud.color = color;
+					Hud.renderer = textRenderer;
+					sprintf(Hud.levelText, "%d", level);
+					sprintf(Hud.livesText, "%d", lives);
+					sprintf(Hud.scoreText, "%d", score);
+					Stats.hudRebuilds++;
+				}
 
-					10000,0,10000, // vertex 3
-					0,0,10000, // vertex 4
-					0,0,0 // vertex 1
-				};
+				if (textRenderer != TEXT_ATLAS) {
+					// FTGL keeps its own glyph geometry, only the strings are cached
+					beginText(color);
+					drawHudStrings();
+					endText();
+					return;
+				}
 
-				static const GLfloat color_buffer_data [] = {
-					0,1,1, // color 1
-					0,1,1, // color 2
-					0,1,1, // color 3
+				if (changed) {
+					beginText(color);
+					drawHudStrings();
+					GLsizeiptr bytes = TextAtlas.vertices.size()*sizeof(TextVertex);
+					if (!Hud.Buffer) {
+						Hud.Handle = createBuffer(GL_ARRAY_BUFFER, 0, NULL, GL_DYNAMIC_DRAW, MEMORY_FONTS, "hud text");
+						Hud.Buffer = resourceName(Hud.Handle);
+					}
+					glBindBuffer(GL_ARRAY_BUFFER, Hud.Buffer);
+					glBufferData(GL_ARRAY_BUFFER, bytes, TextAtlas.vertices.empty() ? NULL : &TextAtlas.vertices[0], GL_DYNAMIC_DRAW);
+					setResourceBytes(Hud.Handle, bytes);
+					Hud.count = TextAtlas.vertices.size();
+					TextAtlas.vertices.clear();
+				}
+				if (Hud.count > 0)
+					drawAtlasQuads(Hud.Buffer, 0, Hud.count);
+			}
 
-					0,1,1, // color 3
-					0,1,1, // color 4
-					0,1,1  // color 1
-				};
-				static const GLfloat texture_buffer_data [] = {
-					0,1, // TexCoord 1 - bot left
-					1,1, // TexCoord 2 - bot right
-					1,0, // TexCoord 3 - top right
+			/* Profiler overlay: the running frame cost and the live GPU memory of every category, small in the bottom
+			 * left corner and red while over the memory budget. It is rebuilt every frame, so it needs the atlas - FTGL
+			 * text cannot be scaled down */
+			#define OVERLAY_TEXT_SIZE 0.5f // ems
+			#define OVERLAY_MARGIN 0.15f
 
-					1,0, // TexCoord 3 - top right
-					0,0, // TexCoord 4 - top left
-					0,1  // TexCoord 1 - bot left
-				};
-				// create3DObject creates and returns a handle to a VAO that can be used later
-				return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data ,textureID, GL_FILL);
+			void drawProfilerOverlay ()
+			{
+				if (textRenderer != TEXT_ATLAS)
+					return;
+				// The HUD plane is 3 units in front of its camera, so the window edges follow from the projection
+				float left = -3/Matrices.projection[0][0] + OVERLAY_MARGIN;
+				float bottom = -3/Matrices.projection[1][1] + OVERLAY_MARGIN;
+				float line = OVERLAY_TEXT_SIZE*GLYPH_EM*1.2f;
+
+				char text[64];
+				beginText(Resources.overBudget ? glm::vec3(1,0,0) : glm::vec3(0,0,0));
+				float y = bottom;
+				for (int c=MEMORY_CATEGORIES-1; c>=0; c--, y += line) {
+					snprintf(text, sizeof(text), "  %s %.2f MB", memoryCategoryNames[c], Resources.categoryBytes[c]/(1024.0*1024.0));
+					queueAtlasText(left, y, text, OVERLAY_TEXT_SIZE);
+				}
+				if (Resources.budget)
+					snprintf(text, sizeof(text), "gpu memory %.2f / %.0f MB", Resources.totalBytes/(1024.0*1024.0), Resources.budget/(1024.0*1024.0));
+				else
+					snprintf(text, sizeof(text), "gpu memory %.2f MB", Resources.totalBytes/(1024.0*1024.0));
+				queueAtlasText(left, y, text, OVERLAY_TEXT_SIZE);
+				y += line;
+				snprintf(text, sizeof(text), "frame %.2f ms cpu, %.2f ms gpu", Idle.cpuMs, Idle.gpuMs);
+				queueAtlasText(left, y, text, OVERLAY_TEXT_SIZE);
+				endText();
 			}
 
-			float camera_rotation_angle = 75;
-			float rectangle_rotation = 0;
-			float obstacle_rotation = 0;
+			/* Fixed camera for 2D (ortho) in XY plane */
+			glm::mat4 hudViewProjection ()
+			{
+				return Matrices.projection * glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0));
+			}
+
+			/* Draw the in-game HUD many times with each text renderer and report the cost of one HUD */
+			void benchText ()
+			{
+				const int iterations = 500;
+				const int renderers[2] = { TEXT_FTGL, TEXT_ATLAS };
+				const char* names[2] = { "ftgl", "atlas" };
+				int active = textRenderer;
+				for (int r=0; r<2; r++) {
+					if (renderers[r] == TEXT_ATLAS && !TextAtlas.TextureID)
+						continue;
+					textRenderer = renderers[r];
+					glFinish();
+					double start = glfwGetTime(), submit = 0;
+					for (int i=0; i<iterations; i++) {
+						beginUploadFrame();
+						FrameData.data.hudVP = hudViewProjection();
+						uploadFrameData();
+						double submitStart = glfwGetTime();
+						beginText(glm::vec3(1, 0, 0));
+						drawText(4, 4, "LEVEL : ");
+						drawText(6.5, 4, "1");
+						drawText(4, 3, "LIFES : ");
+						drawText(6.5, 3, "10");
+						drawText(4, 2, "SCORE : ");
+						drawText(6.5, 2, "0");
+						endText();
+						submit += glfwGetTime() - submitStart;
+						endUploadFrame();
+					}
+					glFinish();
+					double total = glfwGetTime() - start;
+					cout << "TEXT BENCH [" << names[r] << "]: " << total*1000/iterations << " ms per HUD, " << submit*1000/iterations << " ms cpu submit" << endl;
+				}
+				textRenderer = active;
+			}
 
 			/* Render the scene with openGL */
 			/* Edit this function according to your assignment */
 			void draw ()
 			{
+				TraceScope trace("draw");
 				user.checkwin();
 
 				// clear the color and depth in the frame buffer
 				glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-				// use the loaded shader program
-				// Don't change unless you know what you are doing
-				glUseProgram (programID);
-				// Target - Where is the camera looking at.  Don't change unless you are sure!!
 				// Eye - Location of camera. Don't change unless you are sure!!
 				glm::vec3 eye (eyex, eyey, eyez);
 				// Target - Where is the camera looking at.  Don't change unless you are sure!!
@@ -2136,33 +5575,23 @@ class player
 
 				// Compute Camera matrix (view)
 				Matrices.view = glm::lookAt(eye, target, up); // Rotating Camera for 3D
-				//  Don't change unless you are sure!!
-				//Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 			2D (ortho) in XY plane
+				Scene.eye = eye;
 
-				// Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-				//  Don't change unless you are sure!!
-				glm::mat4 VP = Matrices.projection * Matrices.view;
+				// Per-frame camera data goes to the shared FrameData block once; objects only send their instance offset
+				FrameData.data.view = Matrices.view;
+				FrameData.data.projection = Matrices.projection;
+				FrameData.data.VP = Matrices.projection * Matrices.view;
+				FrameData.data.hudVP = hudViewProjection();
+				FrameData.data.time = glm::vec4((float)glfwGetTime(), 0, 0, 0);
+				uploadFrameData();
 
-				// Send our transformation to the currently bound shader, in the "MVP" uniform
-				// For each model you render, since the MVP will be different (at least the M part)
-				//  Don't change unless you are sure!!
-
-				glm::mat4 MVP;	
 				static int fontScale = 0;
 				float fontScaleValue = 0.75 + 0.25*sinf(fontScale*M_PI/180.0f);
 				glm::vec3 fontColor = getRGBfromHue (fontScale);
 
 				if(won!=1 and lost!=1)
-				{	// MVP = Projection * View * Model
-					glUseProgram(textureProgramID);
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translateback = glm::translate (glm::vec3(-4000,0,-4000));
-					//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-					Matrices.model *= translateback ;//* rotatecube;
-					MVP = VP * Matrices.model;
-					glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-					glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-					draw3DTexturedObject(back);
+				{
+					Scene.water.push_back(glm::vec4(-4000, 0, -4000, 0));
 					// Increment angles
 					//  float increments = 1;
 					// camera_rotation_angle++; // Simulating camera rotation
@@ -2187,7 +5616,7 @@ class player
 						uptiles = 1;
 					}	
 
-					int i=0,j=0,random,randomevil,angle,p,q;
+					int i=0,j=0,random,randomevil,p,q;
 					if(levelchange==1)
 					{
 						for(p=0;p<=10;p++)
@@ -2240,98 +5669,7 @@ class player
 								}
 								if(j!=random)
 								{
-									glUseProgram (programID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translatecube = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translatecube ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									//glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-									draw3DObject(cube);
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-
-
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect1 = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect1 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-									draw3DTexturedObject(rect1);
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect2 = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect2 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect2);
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect3 = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect3 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect3);
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect4 = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect4 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect4);
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect5 = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect5 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect5);
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect6 = glm::translate (glm::vec3(x, y, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect6 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect6);
-
-
-
+									drawTile(x, 0, z, y);
 								}
 								if(j==randomevil)
 								{
@@ -2345,17 +5683,7 @@ class player
 										b[9][9]=0;
 										b[9][randomevil]=1;
 									}
-									for(angle=0;angle<=360;angle++)
-									{
-										glUseProgram (programID);
-										Matrices.model = glm::mat4(1.0f);
-										glm::mat4 translateobstacle = glm::translate (glm::vec3(x+15, 160, z+15));
-										glm::mat4 rotateobstacle = glm::rotate((float)(angle*M_PI/180.0f), glm::vec3(0,1,0)); 
-										Matrices.model *= translateobstacle * rotateobstacle;
-										MVP = VP * Matrices.model;
-										glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-										draw3DObject(obstacleex);
-									}	
+									drawEnemy(x+15, 160, z+15);
 								}
 								x=x+30;
 							}
@@ -2399,92 +5727,7 @@ class player
 							{
 
 								if(a[i][j]!=1 && a[i][j]!=2){
-									glUseProgram (programID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translatecube = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translatecube ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									//	glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-									draw3DObject(cube);
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect1 = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect1 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-									draw3DTexturedObject(rect1);
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect2 = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect2 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-									draw3DTexturedObject(rect2);
-									// draw3DObject draws the VAO given to it using current MVP matrix
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect3 = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect3 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect3);
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect4 = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect4 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect4);
-
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect5 = glm::translate (glm::vec3(x, 0, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect5 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect5);
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect6 = glm::translate (glm::vec3(x, y+0.5, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect6 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect6);
-
-
+									drawTile(x, 0, z, y+0.5);
 
 									if(freflag == 1)
 									{
@@ -2511,17 +5754,7 @@ class player
 												b[i][user.j] = 0;
 												b[i][randomevil] = 1;
 											}
-											for(angle=0;angle<=360;angle++)
-											{
-												glUseProgram (programID);
-												Matrices.model = glm::mat4(1.0f);
-												glm::mat4 translateobstacle = glm::translate (glm::vec3(x+15, 160, z+15));
-												glm::mat4 rotateobstacle = glm::rotate((float)(angle*M_PI/180.0f), glm::vec3(0,1,0)); 
-												Matrices.model *= translateobstacle * rotateobstacle;
-												MVP = VP * Matrices.model;
-												glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-												draw3DObject(obstacleex);
-											}
+											drawEnemy(x+15, 160, z+15);
 										}
 										freflag = 1;
 									}
@@ -2529,107 +5762,13 @@ class player
 									{	
 										if(b[i][j]==1)
 										{
-											for(angle=0;angle<=360;angle++)
-											{
-												glUseProgram (programID);
-												Matrices.model = glm::mat4(1.0f);
-												glm::mat4 translateobstacle = glm::translate (glm::vec3(x+15, 115, z+15));
-												glm::mat4 rotateobstacle = glm::rotate((float)(angle*M_PI/180.0f), glm::vec3(0,1,0)); 
-												Matrices.model *= translateobstacle * rotateobstacle;
-												MVP = VP * Matrices.model;
-												glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-												draw3DObject(obstacleex);
-											}
+											drawEnemy(x+15, 115, z+15);
 										}
 									}
 								}
 								if((a[i][j]==1 and i%2==0) || a[i][j] == 2)
 								{
-									glUseProgram (programID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translatecube = glm::translate (glm::vec3(x, tilesy, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translatecube ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									draw3DObject(cube);
-
-
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect1 = glm::translate (glm::vec3(x, tilesy, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect1 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-									draw3DTexturedObject(rect1);
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect2 = glm::translate (glm::vec3(x, tilesy, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect2 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-									draw3DTexturedObject(rect2);
-									// draw3DObject draws the VAO given to it using current MVP matrix
-
-
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect3 = glm::translate (glm::vec3(x, tilesy, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect3 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect3);
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect4 = glm::translate (glm::vec3(x, tilesy, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect4 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect4);
-
-
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect5 = glm::translate (glm::vec3(x, tilesy, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect5 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect5);
-									glUseProgram(textureProgramID);
-									Matrices.model = glm::mat4(1.0f);
-									glm::mat4 translaterect6 = glm::translate (glm::vec3(x, tilesy + 100.5, z));
-									//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-									Matrices.model *= translaterect6 ;//* rotatecube;
-									MVP = VP * Matrices.model;
-									glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-									glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-
-									// draw3DObject draws the VAO given to it using current MVP matrix
-									//draw3DTexturedObject(rectangle);
-									draw3DTexturedObject(rect6);
+									drawTile(x, tilesy, z, tilesy + 100.5);
 									a[i][j]=2;
 								}
 								x=x+30;
@@ -2648,143 +5787,34 @@ class player
 					user.checkcollision();
 					user.checksliding();
 					user.checkboundary();
-					glUseProgram (programID);
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translatecube = glm::translate (glm::vec3(user.x, user.y,user.z));
-					//glm::mat4 rotatecube = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)); 
-					Matrices.model *= translatecube ;//* rotatecube;
-					MVP = VP * Matrices.model;
-					glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-					draw3DObject(cubetest);
-
-
-
-
-
-
-					// Use font Shaders for next part of code
-					glUseProgram(fontProgramID);
-					Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-					// Transform the tex
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translateText = glm::translate(glm::vec3(4,4,0));
-					//glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-					Matrices.model *= translateText; //* scaleText);
-					MVP = Matrices.projection * Matrices.view * Matrices.model;
-					// send font's MVP and font color to fond shaders
-					glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-					glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-
-					// Render font
-					GL3Font.font->Render("LEVEL : ");
-
-					//glUseProgram(fontProgramID);
-					Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-					// Transform the tex
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translateText2 = glm::translate(glm::vec3(6.5,4,0));
-					//glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-					Matrices.model *= translateText2; //* scaleText);
-					MVP = Matrices.projection * Matrices.view * Matrices.model;
-					// send font's MVP and font color to fond shaders
-					glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-					glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-
-					// Render font
-					char pri[10];
-					sprintf(pri,"%d",count+1);
-					GL3Font.font->Render(pri);
-
-
-
-					//glUseProgram(fontProgramID);
-					Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-					// Transform the tex
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translateText4 = glm::translate(glm::vec3(4,3,0));
-					//glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-					Matrices.model *= translateText4; //* scaleText);
-					MVP = Matrices.projection * Matrices.view * Matrices.model;
-					// send font's MVP and font color to fond shaders
-					glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-					glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-
-					// Render font
-					GL3Font.font->Render("LIFES : ");
-
-
-
-					// Transform the tex
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translateText3 = glm::translate(glm::vec3(6.5,3,0));
-					//glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-					Matrices.model *= translateText3; //* scaleText);
-					MVP = Matrices.projection * Matrices.view * Matrices.model;
-					// send font's MVP and font color to fond shaders
-					glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-					glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-
-					// Render font
-
-					sprintf(pri,"%d",10-lifes);
-					GL3Font.font->Render(pri);
-
-					//glUseProgram(fontProgramID);
-					Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-					// Transform the tex
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translateText5 = glm::translate(glm::vec3(4,2,0));
-					//glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-					Matrices.model *= translateText5; //* scaleText);
-					MVP = Matrices.projection * Matrices.view * Matrices.model;
-					// send font's MVP and font color to fond shaders
-					glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-					glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
+					Scene.players.push_back(glm::vec4(user.x, user.y, user.z, 0));
+					beginSceneTarget();
+					drawScene();
+					if (heatmap) {
+						// The HUD is counted too, so it goes into the scene target ahead of the heat colours
+						glViewport(0, 0, SceneTarget.width, SceneTarget.height);
+						glClear(GL_DEPTH_BUFFER_BIT);
+						compositeMinimap();
+						drawHud(fontColor);
+					}
+					endSceneTarget();
+					if (!heatmap)
+						compositeMinimap();
 
-					// Render font
-					GL3Font.font->Render("SCORE : ");
 
 
 
-					// Transform the tex
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translateText6 = glm::translate(glm::vec3(6.5,2,0));
-					//glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-					Matrices.model *= translateText6; //* scaleText);
-					MVP = Matrices.projection * Matrices.view * Matrices.model;
-					// send font's MVP and font color to fond shaders
-					glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-					glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
 
-					// Render font
 
-					sprintf(pri,"%d",score);
-					GL3Font.font->Render(pri);
+					// The HUD camera lives in FrameData.hudVP and the HUD geometry is cached until a value changes
+					if (!heatmap)
+						drawHud(fontColor);
+					if (profilerOverlay)
+						drawProfilerOverlay();
 
 				}
 
 
-				/*float lifesx = 300; 
-				  for( int e=0; e<(10-lifes); e++)
-				  {
-				  glUseProgram (programID);
-				  Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-				  Matrices.model = glm::mat4(1.0f);
-				  glm::mat4 rotatelifes = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,0,1)); 
-				  glm::mat4 translatelifes = glm::translate (glm::vec3(lifesx-(e*50),250,0));        // glTranslatef
-				// rotate about vector (-1,1,1)
-				Matrices.model *= translatelifes*rotatelifes;
-				MVP = VP * Matrices.model;
-				glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-				// draw3DObject draws the VAO given to it using current MVP matrix
-				draw3DObject(obstacleex);
-				}*/
-
-
 				//camera_rotation_angle++; // Simulating camera rotation
 				//triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
 				//rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
@@ -2794,78 +5824,17 @@ class player
 
 				if(won == 1)
 				{
-					glUseProgram(fontProgramID);
-					Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-					// Transform the tex
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translateText15 = glm::translate(glm::vec3(-1,3,0));
-					//glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-					Matrices.model *= translateText15; //* scaleText);
-					MVP = Matrices.projection * Matrices.view * Matrices.model;
-					// send font's MVP and font color to fond shaders
-					glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-					glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-
-					// Render font
-					GL3Font.font->Render("YOU WON!!!");
-
-					glUseProgram(fontProgramID);
-					Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-					// Transform the tex
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translateText20 = glm::translate(glm::vec3(-2,0,0));
-					//glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-					Matrices.model *= translateText20; //* scaleText);
-					MVP = Matrices.projection * Matrices.view * Matrices.model;
-					// send font's MVP and font color to fond shaders
-					glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-					glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-
-					// Render font
-					GL3Font.font->Render("FOR PLAYING AGAIN,PRESS N");
-
-
-
+					beginText(fontColor);
+					drawText(-1, 3, "YOU WON!!!");
+					drawText(-2, 0, "FOR PLAYING AGAIN,PRESS N");
+					endText();
 				}
 				if(lost == 1)
 				{
-					glUseProgram(fontProgramID);
-					Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-					// Transform the tex
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translateText9 = glm::translate(glm::vec3(-1,3,0));
-					//glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-					Matrices.model *= translateText9; //* scaleText);
-					MVP = Matrices.projection * Matrices.view * Matrices.model;
-					// send font's MVP and font color to fond shaders
-					glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-					glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-
-					// Render font
-					GL3Font.font->Render("GAME OVER");
-
-
-					glUseProgram(fontProgramID);
-					Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-					// Transform the tex
-					Matrices.model = glm::mat4(1.0f);
-					glm::mat4 translateText10 = glm::translate(glm::vec3(-2,0,0));
-					//glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-					Matrices.model *= translateText10; //* scaleText);
-					MVP = Matrices.projection * Matrices.view * Matrices.model;
-					// send font's MVP and font color to fond shaders
-					glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-					glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-
-					// Render font
-					GL3Font.font->Render("FOR PLAYING AGAIN,PRESS N");
-
-
-
+					beginText(fontColor);
+					drawText(-1, 3, "GAME OVER");
+					drawText(-2, 0, "FOR PLAYING AGAIN,PRESS N");
+					endText();
 				}
 
 
@@ -2876,27 +5845,46 @@ class player
 			/* Nothing to Edit here */
 			GLFWwindow* initGLFW (int width, int height)
 			{
+				TraceScope trace("initGLFW");
 				GLFWwindow* window; // window desciptor/handle
 
 				glfwSetErrorCallback(error_callback);
+				double phase = traceNow();
 				if (!glfwInit()) {
 					exit(EXIT_FAILURE);
 				}
+				traceEnd("glfwInit", phase);
 
-				glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-				glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 				glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 				glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-				window = glfwCreateWindow(width, height, "Sample OpenGL 3.3 Application", NULL, NULL);
+				// Ask for 4.3 first so the scene can use multi draw indirect
+				phase = traceNow();
+				window = NULL;
+				if (Options.scenePath == SCENE_PATH_INDIRECT) {
+					glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+					glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+					window = glfwCreateWindow(width, height, "Sample OpenGL 4.3 Application", NULL, NULL);
+				}
+
+				// Fall back to the 3.3 core context
+				if (!window) {
+					glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+					glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+					window = glfwCreateWindow(width, height, "Sample OpenGL 3.3 Application", NULL, NULL);
+				}
 
 				if (!window) {
 					glfwTerminate();
 					exit(EXIT_FAILURE);
 				}
 
+				traceEnd("glfwCreateWindow", phase);
+
 				glfwMakeContextCurrent(window);
+				phase = traceNow();
 				gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+				traceEnd("gladLoadGLLoader", phase);
 				glfwSwapInterval( 1 );
 
 				/* --- register callbacks with GLFW --- */
@@ -2918,13 +5906,45 @@ class player
 				/* Register function to handle mouse click */
 				glfwSetMouseButtonCallback(window, mouseButton);  // mouse button clicks
 
+				/* Register functions to track whether the window is in the background */
+				glfwSetWindowFocusCallback(window, windowFocus);
+				glfwSetWindowIconifyCallback(window, windowIconify);
+				Idle.focused = glfwGetWindowAttrib(window, GLFW_FOCUSED);
+				Idle.iconified = glfwGetWindowAttrib(window, GLFW_ICONIFIED);
+
 				return window;
 			}
 
+			/* Per-program setup, run after every link so reloaded programs get it too */
+			void setupTextureProgram (GLuint program)
+			{
+				// Attach the FrameData block - objects get their offset from the per-instance attribute
+				bindFrameData(program);
+				// The sampler always reads texture unit 0
+				glUseProgram(program);
+				glUniform1i(glGetUniformLocation(program, "texSampler"), 0);
+			}
+
+			void setupFontProgram (GLuint program)
+			{
+				GLint fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform;
+				fontVertexCoordAttrib = glGetAttribLocation(program, "vertexPosition");
+				fontVertexNormalAttrib = glGetAttribLocation(program, "vertexNormal");
+				fontVertexOffsetUniform = glGetUniformLocation(program, "pen");
+				GL3Font.fontOffsetID = glGetUniformLocation(program, "modelOffset");
+				GL3Font.fontColorID = glGetUniformLocation(program, "fontColor");
+
+				bindFrameData(program);
+
+				GL3Font.font->ShaderLocations(fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform);
+			}
+
 			/* Initialize the OpenGL rendering properties */
 			/* Add all the models to be created here */
 			void initGL (GLFWwindow* window, int width, int height)
 			{
+				TraceScope trace("initGL");
+				double initStart = glfwGetTime();
 
 
 				/* Objects should be created before any other gl function and shaders */
@@ -2933,68 +5953,88 @@ class player
 				//createRectangle ();
 				//cube = createCube(30,100,30);
 
-				glActiveTexture(GL_TEXTURE0);
-				// load an image file directly as a new OpenGL texture
-				// GLuint texID = SOIL_load_OGL_texture ("beach.png", SOIL_LOAD_AUTO, SOIL_CREATE_NEW_ID, SOIL_FLAG_TEXTURE_REPEATS); // Buggy for OpenGL3
-				GLuint textureID = createTexture("crate.jpg");
-				// check for an error during the load process
-				if(textureID == 0 )
-					cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
+				// Direct state access has to be decided before the ring and the meshes are created
+				dsaPath = Options.dsa && dsaSupported();
+
+				// Streaming buffer for per-frame uniform blocks and instance offsets
+				createUploadRing();
+
+				// DXT1 needs the extension; the cache files remember which format they hold
+				textureFormat = (Options.compressTextures && GLAD_GL_EXT_texture_compression_s3tc) ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_RGB;
+
+				// Decode every image on worker threads while the context thread builds shaders and meshes.
+				// Texture names are generated now so the meshes can reference them before the upload.
+				vector<TextureJob> textures(3);
+				textures[0].filename = "crate.jpg";
+				textures[1].filename = "texture.png";
+				textures[2].filename = "water2.jpg";
+				for (size_t t=0; t<textures.size(); t++) {
+					textures[t].Texture = createTextureName(MEMORY_TEXTURES, textures[t].filename);
+					textures[t].TextureID = resourceName(textures[t].Texture);
+				}
+				TextureDecoder decoder;
+				startTextureDecode(decoder, textures);
+				TextureHandle textureID = textures[0].Texture;
+				TextureHandle textureIDup = textures[1].Texture;
+				TextureHandle textureIDwater = textures[2].Texture;
 
 				// Create and compile our GLSL program from the texture shaders
-				textureProgramID = LoadShaders( "TextureRender.vert", "TextureRender.frag" );
-				// Get a handle for our "MVP" uniform
-				Matrices.TexMatrixID = glGetUniformLocation(textureProgramID, "MVP");
+				getProgram( "TextureRender.vert", "TextureRender.frag", textureProgramID, setupTextureProgram );
 
 
 				/* Objects should be created before any other gl function and shaders */
 				// Create the models
 				//createTriangle (); // Generate the VAO, VBOs, vertices data & copy into the array buffer
+				double meshStart = glfwGetTime();
 				cube = createCube ();
 				cubetest = user.createCube(15,15,15);
-				obstacleex = obstacle.createCircle();
+				for (int l=0; l<ENEMY_LOD_LEVELS; l++)
+					obstacleLod[l] = obstacle.createCircle(enemyLodSegments[l]);
 				rect1 = createRectangleBack(textureID);
 				rect2 = createRectangleUP(textureID);
 				rect3 = createRectangleFront(textureID);
 				rect4 = createRectangleDown(textureID);
-				rect5 = createRectangleDown(textureID);
-
-
-				glActiveTexture(GL_TEXTURE0);
-				// load an image file directly as a new OpenGL texture
-				// GLuint texID = SOIL_load_OGL_texture ("beach.png", SOIL_LOAD_AUTO, SOIL_CREATE_NEW_ID, SOIL_FLAG_TEXTURE_REPEATS); // Buggy for OpenGL3
-				GLuint textureIDup = createTexture("texture.png");
-				// check for an error during the load process
-				if(textureIDup == 0 )
-					cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
-
-				// Create and compile our GLSL program from the texture shaders
-				textureProgramID = LoadShaders( "TextureRender.vert", "TextureRender.frag" );
-				// Get a handle for our "MVP" uniform
-				Matrices.TexMatrixID = glGetUniformLocation(textureProgramID, "MVP");
 				rect6 = createRectangleRight(textureIDup);
+				back = createRectangle(textureIDwater);
 
-
+				// Every mesh is created by now - copy them into the shared arena for the indirect path
+				buildMeshArena();
+				Startup.meshes += (glfwGetTime() - meshStart) * 1000;
+				scenePath = (Options.scenePath == SCENE_PATH_INDIRECT && indirectSupported()) ? SCENE_PATH_INDIRECT : SCENE_PATH_INSTANCED;
+				if (Options.benchScene)
+					createGpuTimer(sceneTimer);
+				createGpuTimer(SceneTarget.timer);
+				SceneTarget.scale = Options.sceneScale > 0 ? min(1.0f, max(SCENE_SCALE_MIN, Options.sceneScale)) : 1.0f;
+				for (int v=0; v<SCENE_VIEWS; v++)
+					createGpuTimer(sceneViews[v].timer);
+				multiView = Options.multiView;
+				minimap = Options.minimap;
+				cullFaces = Options.cullFaces;
+				depthPrepass = Options.depthPrepass;
+				heatmap = Options.heatmap;
+				uberShader = Options.uberShader;
+				profilerOverlay = Options.profilerOverlay;
+
+				// Only the uploads need the context
+				finishTextureDecode(decoder);
 				glActiveTexture(GL_TEXTURE0);
-				// load an image file directly as a new OpenGL texture
-				// GLuint texID = SOIL_load_OGL_texture ("beach.png", SOIL_LOAD_AUTO, SOIL_CREATE_NEW_ID, SOIL_FLAG_TEXTURE_REPEATS); // Buggy for OpenGL3
-				GLuint textureIDwater = createTexture("water2.jpg");
-				// check for an error during the load process
-				if(textureIDwater == 0 )
-					cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
-
-				// Create and compile our GLSL program from the texture shaders
-				textureProgramID = LoadShaders( "TextureRender.vert", "TextureRender.frag" );
-				// Get a handle for our "MVP" uniform
-				Matrices.TexMatrixID = glGetUniformLocation(textureProgramID, "MVP");
-
-				back = createRectangle(textureIDwater);
+				// With the finished material array in the texture cache its sources are never uploaded. Otherwise
+				// the material array holds the references until it has copied the textures into its layers
+				bool materialsCached = loadMaterialArray(textures);
+				for (size_t t=0; t<textures.size(); t++) {
+					if (materialsCached && isMaterialSource(textures[t].Texture))
+						skipTextureUpload(textures[t]);
+					else
+						uploadTexture(textures[t]);
+					releaseResource(textures[t].Texture);
+				}
+				buildMaterialArray();
 
 
 				// Create and compile our GLSL program from the shaders
-				programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-				// Get a handle for our "MVP" uniform
-				Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+				getProgram( "Sample_GL.vert", "Sample_GL.frag", programID, bindFrameData );
+				// Both materials in one program, with the same sampler setup as the textured one
+				getProgram( "scene.vert", "scene.frag", sceneProgramID, setupTextureProgram );
 
 
 				reshapeWindow (window, width, height);
@@ -3008,7 +6048,15 @@ class player
 				glDepthFunc (GL_LEQUAL);
 
 				const char* fontfile = "arial.ttf";
-				GL3Font.font = new FTExtrudeFont(fontfile); // 3D extrude style rendering
+				// FreeType reads the face lazily, so only a packed font (which stays mapped) is loaded from memory
+				AssetView fontAsset;
+				{
+					TraceScope trace("FTExtrudeFont", fontfile);
+					if (findAsset(fontfile, fontAsset))
+						GL3Font.font = new FTExtrudeFont(fontAsset.data, fontAsset.size); // 3D extrude style rendering
+					else
+						GL3Font.font = new FTExtrudeFont(fontfile);
+				}
 
 				if(GL3Font.font->Error())
 				{
@@ -3018,29 +6066,190 @@ class player
 				}
 
 				// Create and compile our GLSL program from the font shaders
-				fontProgramID = LoadShaders( "fontrender.vert", "fontrender.frag" );
-				GLint fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform;
-				fontVertexCoordAttrib = glGetAttribLocation(fontProgramID, "vertexPosition");
-				fontVertexNormalAttrib = glGetAttribLocation(fontProgramID, "vertexNormal");
-				fontVertexOffsetUniform = glGetUniformLocation(fontProgramID, "pen");
-				GL3Font.fontMatrixID = glGetUniformLocation(fontProgramID, "MVP");
-				GL3Font.fontColorID = glGetUniformLocation(fontProgramID, "fontColor");
-
-				GL3Font.font->ShaderLocations(fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform);
+				getProgram( "fontrender.vert", "fontrender.frag", fontProgramID, setupFontProgram );
 				GL3Font.font->FaceSize(1);
 				GL3Font.font->Depth(0);
 				GL3Font.font->Outset(0, 0);
 				GL3Font.font->CharMap(ft_encoding_unicode);
+
+				// The atlas renderer needs its own program and texture; FTGL stays as the fallback
+				textRenderer = TEXT_FTGL;
+				if ((Options.textRenderer == TEXT_ATLAS || Options.benchText) && buildGlyphAtlas(fontfile)) {
+					getProgram( "textatlas.vert", "textatlas.frag", TextAtlas.programID, setupTextAtlasProgram );
+					if (Options.textRenderer == TEXT_ATLAS)
+						textRenderer = TEXT_ATLAS;
+				}
+				initMinimap();
 				cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
 				cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
 				cout << "VERSION: " << glGetString(GL_VERSION) << endl;
 				cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
+				cout << "SCENE PATH: " << (scenePath == SCENE_PATH_INDIRECT ? "multi draw indirect" : "instanced") << endl;
+				cout << "MESH SETUP: " << (dsaPath ? "direct state access" : "bind to edit") << endl;
+				if (Options.benchText)
+					benchText();
+				if (Options.watchShaders)
+					watchShaders();
+				Startup.total = (glfwGetTime() - initStart) * 1000;
+				cout << "STARTUP: " << Startup.total << " ms - decode " << Startup.decode << " ms (" << Startup.textures << " textures on " << Startup.threads << " threads, waited " << Startup.wait << " ms), upload " << Startup.upload << " ms (" << Startup.cacheHits << "/" << Startup.textures << " from texture cache, " << Startup.uploadsSkipped << " skipped for the cached material array, " << Startup.textureBytes/1024 << " KB), shaders " << Startup.shaders << " ms (" << programBinaryHits << "/" << ShaderRegistry.size() << " programs from binary cache), meshes " << Startup.meshes << " ms" << endl;
+				reportResources("startup");
+			}
+
+			/* Read the command line switches into Options */
+			void parseOptions (int argc, char** argv)
+			{
+				for (int i=1; i<argc; i++) {
+					if (!strcmp(argv[i], "--scene-path") && i+1 < argc) {
+						i++;
+						Options.scenePath = strcmp(argv[i], "instanced") ? SCENE_PATH_INDIRECT : SCENE_PATH_INSTANCED;
+					}
+					else if (!strcmp(argv[i], "--bench-scene"))
+						Options.benchScene = true;
+					else if (!strcmp(argv[i], "--stats"))
+						Options.stats = true;
+					else if (!strcmp(argv[i], "--no-occlusion"))
+						Options.occlusion = false;
+					else if (!strcmp(argv[i], "--compress-textures"))
+						Options.compressTextures = true;
+					else if (!strcmp(argv[i], "--watch-shaders"))
+						Options.watchShaders = true;
+					else if (!strcmp(argv[i], "--trace") && i+1 < argc)
+						Options.traceFile = argv[++i];
+					else if (!strcmp(argv[i], "--text") && i+1 < argc) {
+						i++;
+						Options.textRenderer = strcmp(argv[i], "ftgl") ? TEXT_ATLAS : TEXT_FTGL;
+					}
+					else if (!strcmp(argv[i], "--bench-text"))
+						Options.benchText = true;
+					else if (!strcmp(argv[i], "--no-idle"))
+						Options.idle = false;
+					else if (!strcmp(argv[i], "--record") && i+1 < argc)
+						Options.recordFile = argv[++i];
+					else if (!strcmp(argv[i], "--scene-scale") && i+1 < argc)
+						Options.sceneScale = atof(argv[++i]);
+					else if (!strcmp(argv[i], "--frame-budget") && i+1 < argc)
+						Options.frameBudget = atof(argv[++i]);
+					else if (!strcmp(argv[i], "--multi-view"))
+						Options.multiView = true;
+					else if (!strcmp(argv[i], "--no-minimap"))
+						Options.minimap = false;
+					else if (!strcmp(argv[i], "--no-cull"))
+						Options.cullFaces = false;
+					else if (!strcmp(argv[i], "--depth-prepass"))
+						Options.depthPrepass = true;
+					else if (!strcmp(argv[i], "--overdraw"))
+						Options.overdraw = true;
+					else if (!strcmp(argv[i], "--heatmap"))
+						Options.heatmap = true;
+					else if (!strcmp(argv[i], "--split-shaders"))
+						Options.uberShader = false;
+					else if (!strcmp(argv[i], "--overlay"))
+						Options.profilerOverlay = true;
+					else if (!strcmp(argv[i], "--memory-budget") && i+1 < argc)
+						Options.memoryBudget = atof(argv[++i]);
+					else if (!strcmp(argv[i], "--no-dsa"))
+						Options.dsa = false;
+					else
+						cout << "Unknown option: " << argv[i] << endl;
+				}
+			}
+
+			GLGpuTimer frameTimer;
+
+			/* Print how much drawing idle mode saved, against drawing every frame at ACTIVE_FRAME_RATE */
+			void reportIdle ()
+			{
+				double seconds = Idle.checked - Idle.since;
+				int expected = seconds * ACTIVE_FRAME_RATE;
+				int skipped = max(0, expected - Idle.frames);
+				cout << "IDLE: " << seconds << " s, drew " << Idle.frames << " frames instead of ~" << expected << ", saved ~" << skipped*Idle.cpuMs << " ms cpu, ~" << skipped*Idle.gpuMs << " ms gpu" << endl;
+			}
+
+			/* Still report an idle period that lasts until the game is closed */
+			void closeIdle ()
+			{
+				if (Idle.active)
+					reportIdle();
+			}
+
+			/* Enter or leave idle mode - returns whether the loop should idle this iteration */
+			bool updateIdle ()
+			{
+				bool idle = Options.idle && (won || lost || !Idle.focused || Idle.iconified);
+				Idle.checked = glfwGetTime();
+				if (idle && !Idle.active) {
+					Idle.since = Idle.checked;
+					Idle.frames = 0;
+				}
+				else if (!idle && Idle.active)
+					reportIdle();
+				Idle.active = idle;
+				return idle;
+			}
+
+			/* Block until input arrives or the next idle tick is due - returns whether to draw a frame */
+			bool waitIdle ()
+			{
+				// Nothing is visible while iconified, so only input wakes the loop and nothing is drawn
+				double wait = Idle.iconified ? IDLE_TICK_SECONDS : Idle.lastDraw + IDLE_TICK_SECONDS - glfwGetTime();
+				if (!Idle.wake && wait > 0) {
+					double phase = traceNow();
+					glfwWaitEventsTimeout(wait);
+					traceEnd("glfwWaitEventsTimeout", phase);
+				}
+				Idle.checked = glfwGetTime();
+				// The wait may return a little early, so count a tick as due within a millisecond of it
+				bool due = Idle.wake || Idle.checked - Idle.lastDraw >= IDLE_TICK_SECONDS - 0.001;
+				Idle.wake = false;
+				if (Idle.iconified || !due)
+					return false;
+				Idle.frames++;
+				return true;
+			}
+
+			/* Release everything initGL created, in the reverse order, and report anything still alive */
+			void shutdownGL ()
+			{
+				TraceScope trace("shutdownGL");
+				finishRecording();
+				destroyRenderTarget(SceneTarget.target);
+				destroyMinimap();
+				destroyMaterialArray();
+				destroy3DObject(back);
+				destroy3DObject(rect6);
+				destroy3DObject(rect4);
+				destroy3DObject(rect3);
+				destroy3DObject(rect2);
+				destroy3DObject(rect1);
+				for (int l=0; l<ENEMY_LOD_LEVELS; l++)
+					destroy3DObject(obstacleLod[l]);
+				destroy3DObject(cubetest);
+				destroy3DObject(cube);
+				destroyMeshArena();
+				delete GL3Font.font;
+				GL3Font.font = NULL;
+				releaseResource(Hud.Handle);
+				Hud.Buffer = 0;
+				destroyGlyphAtlas();
+				destroyPrograms();
+				destroyUploadRing();
+				reportResources("shutdown", true);
 			}
 
 			int main (int argc, char** argv)
 			{
 				int width = 1600;
 				int height = 800;
+				parseOptions(argc, argv);
+				Resources.budget = Options.memoryBudget * 1024 * 1024;
+				if (Options.traceFile)
+					openTrace(Options.traceFile);
+				double phase = traceNow();
+				if (openAssetPack(ASSET_PACK_PATH))
+					cout << "ASSETS: " << ASSET_PACK_PATH << ", " << Assets.count << " assets" << endl;
+				else
+					cout << "ASSETS: loose files" << endl;
+				traceEnd("openAssetPack", phase);
 				user.x = 7.5;
 				user.y = 105;
 				user.z = 7.5;	
@@ -3053,6 +6262,10 @@ class player
 				GLFWwindow* window = initGLFW(width, height);
 
 				initGL (window, width, height);
+				createGpuTimer(frameTimer);
+				atexit(closeIdle);
+				if (Options.recordFile)
+					startRecording(Options.recordFile);
 
 
 				//double last_update_time = glfwGetTime(), current_time;
@@ -3061,14 +6274,49 @@ class player
 				/* Draw in loop */
 				while (!glfwWindowShouldClose(window)) {
 
-					// OpenGL Draw commands
+					// Once the game is over or the window is in the background only draw on input or a slow tick
+					if (updateIdle() && !waitIdle()) {
+						flushTrace();
+						continue;
+					}
+
+					// OpenGL Draw commands - per-frame uploads go to the next free region of the ring
+					static int frame = 0;
+					double frameStart = traceNow();
+					double cpuStart = glfwGetTime();
+					reloadChangedShaders();
+					beginGpuTimer(frameTimer);
+					beginUploadFrame();
 					draw();
+					endUploadFrame();
+					endGpuTimer(frameTimer);
+					Idle.lastDraw = glfwGetTime();
+					if (!Idle.active) {
+						// Running average of what an active frame costs, for the idle savings estimate
+						Idle.cpuMs += ((Idle.lastDraw - cpuStart) * 1000 - Idle.cpuMs) * 0.05;
+						Idle.gpuMs += (frameTimer.LastMs - Idle.gpuMs) * 0.05;
+					}
+
+					// Read the frame back for --record before it is presented
+					captureFrame();
 
 					// Swap Frame Buffer in double buffering
+					phase = traceNow();
 					glfwSwapBuffers(window);
+					traceEnd("glfwSwapBuffers", phase);
+					if (frame++ == 0 && Options.traceFile) {
+						traceInstant("first frame presented");
+						cout << "FIRST FRAME: " << traceNow() / 1000 << " ms after tracing started" << endl;
+					}
 
-					// Poll for Keyboard and mouse events
-					glfwPollEvents();
+					// Poll for Keyboard and mouse events - idle mode waits for them at the top of the loop instead
+					if (!Idle.active) {
+						phase = traceNow();
+						glfwPollEvents();
+						traceEnd("glfwPollEvents", phase);
+					}
+					traceEnd("frame", frameStart);
+					flushTrace();
 
 					// Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
 					//   current_time = glfwGetTime(); // Time in seconds
@@ -3106,6 +6354,8 @@ class player
 					}
 				}
 
+				shutdownGL();
+				glfwDestroyWindow(window);
 				glfwTerminate();
 				exit(EXIT_SUCCESS);
 			}
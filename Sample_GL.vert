@@ -4,19 +4,34 @@
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 1) in vec3 vertexColor;
 
-uniform mat4 MVP;
+// per-frame data : written once per frame, shared by all programs
+layout (std140) uniform FrameData
+{
+    mat4 view;
+    mat4 projection;
+    mat4 VP;
+    mat4 hudVP;
+    vec4 time;
+};
+
+// per-instance data : xyz = translation, w = rotation about +Y (radians)
+layout (location = 3) in vec4 instanceOffset;
 
 // output data : used by fragment shader
 out vec3 fragColor;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    // Model transform = translate(instanceOffset.xyz) * rotateY(instanceOffset.w)
+    float c = cos(instanceOffset.w);
+    float s = sin(instanceOffset.w);
+    vec3 p = vec3(c*vertexPosition.x + s*vertexPosition.z, vertexPosition.y, c*vertexPosition.z - s*vertexPosition.x);
+    vec4 v = vec4(p + instanceOffset.xyz, 1); // Transform an homogeneous 4D vector
 
     // The color of each vertex will be interpolated
     // to produce the color of each fragment
     fragColor = vertexColor;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : VP * model * position
+    gl_Position = VP * v;
 }
@@ -1,13 +1,13 @@
 #version 330 core
 
 // Interpolated values from the vertex shaders
-in vec2 fragTexCoord;
+in vec3 fragTexCoord;
 
 // output data
 out vec3 color;
 
-// Texture sample for the whole mesh
-uniform sampler2D texSampler;
+// Every material, one layer each
+uniform sampler2DArray texSampler;
 
 void main()
 {
@@ -2,21 +2,36 @@
 
 // input data : sent from main program
 layout (location = 0) in vec3 vertexPosition;
-layout (location = 2) in vec2 vertexTexCoord;
+layout (location = 2) in vec3 vertexTexCoord; // s, t, material layer
 
-uniform mat4 MVP;
+// per-frame data : written once per frame, shared by all programs
+layout (std140) uniform FrameData
+{
+    mat4 view;
+    mat4 projection;
+    mat4 VP;
+    mat4 hudVP;
+    vec4 time;
+};
+
+// per-instance data : xyz = translation, w = rotation about +Y (radians)
+layout (location = 3) in vec4 instanceOffset;
 
 // output data : used by fragment shader
-out vec2 fragTexCoord;
+out vec3 fragTexCoord;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    // Model transform = translate(instanceOffset.xyz) * rotateY(instanceOffset.w)
+    float c = cos(instanceOffset.w);
+    float s = sin(instanceOffset.w);
+    vec3 p = vec3(c*vertexPosition.x + s*vertexPosition.z, vertexPosition.y, c*vertexPosition.z - s*vertexPosition.x);
+    vec4 v = vec4(p + instanceOffset.xyz, 1); // Transform an homogeneous 4D vector
 
     // The texture coord of each vertex will be interpolated
     // to produce the color of each fragment
     fragTexCoord = vertexTexCoord;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : VP * model * position
+    gl_Position = VP * v;
 }
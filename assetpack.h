@@ -0,0 +1,27 @@
+#ifndef ASSETPACK_H
+#define ASSETPACK_H
+
+#include <stdint.h>
+
+/* Layout of assets.pak, written by packassets and mmap'd by the game */
+/* Header, then 'count' index entries, then the blobs - each blob starts on an ASSET_PACK_ALIGN boundary */
+
+#define ASSET_PACK_MAGIC 0x4b503241 // "A2PK" on disk
+#define ASSET_PACK_VERSION 1
+#define ASSET_PACK_ALIGN 64
+#define ASSET_PACK_NAME_LENGTH 48
+
+struct AssetPackHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;    // number of index entries following the header
+	uint32_t reserved;
+};
+
+struct AssetPackEntry {
+	char name[ASSET_PACK_NAME_LENGTH]; // file name the asset was packed from, NUL terminated
+	uint64_t offset;                   // from the start of the pack
+	uint64_t size;                     // in bytes, the blob is not NUL terminated
+};
+
+#endif
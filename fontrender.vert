@@ -1,6 +1,17 @@
 #version 330 core
 
-uniform mat4 MVP;
+// per-frame data : written once per frame, shared by all programs
+layout (std140) uniform FrameData
+{
+    mat4 view;
+    mat4 projection;
+    mat4 VP;
+    mat4 hudVP;
+    vec4 time;
+};
+
+// per-string data : xyz = position of the string on the HUD plane
+uniform vec4 modelOffset;
 uniform vec3 pen;
 uniform vec3 fontColor;
 
@@ -11,7 +22,8 @@ out vec3 fragColor;
 
 void main ()
 {
-    gl_Position = MVP * (vec4(vertexPosition, 1.0) + vec4(pen, 1.0));
+    vec4 v = vec4(vertexPosition, 1.0) + vec4(pen, 1.0);
+    gl_Position = hudVP * vec4(v.xyz + modelOffset.xyz * v.w, v.w);
     // fragColor = vec3((vertexNormal.x+1)/2,(vertexNormal.y+1)/2,(vertexNormal.z+1)/2);
     fragColor = fontColor;
-}
\ No newline at end of file
+}
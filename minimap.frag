@@ -0,0 +1,15 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec2 fragTexCoord;
+
+// output data
+out vec3 color;
+
+// Top-down render of the board, refreshed only when it changes
+uniform sampler2D minimap;
+
+void main()
+{
+    color = texture(minimap, fragTexCoord).rgb;
+}
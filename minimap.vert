@@ -0,0 +1,15 @@
+#version 330 core
+
+// corners of the minimap in clip space : xy = lower left, zw = upper right
+uniform vec4 rect;
+
+// output data : used by fragment shader
+out vec2 fragTexCoord;
+
+void main ()
+{
+    // Triangle strip over the four corners, generated from the vertex index so no buffer is bound
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+    gl_Position = vec4(mix(rect.xy, rect.zw, corner), 0.0, 1.0);
+    fragTexCoord = corner;
+}
@@ -0,0 +1,72 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include "assetpack.h"
+
+using namespace std;
+
+/* Pack the files given on the command line into a single asset pack */
+/* Usage: packassets <output.pak> <file>... */
+int main (int argc, char** argv)
+{
+	if (argc < 3) {
+		cerr << "Usage: " << argv[0] << " <output.pak> <file>..." << endl;
+		return 1;
+	}
+
+	int count = argc - 2;
+	vector<AssetPackEntry> entries(count);
+	vector< vector<char> > blobs(count);
+
+	// Blobs start after the header and the index
+	uint64_t offset = sizeof(AssetPackHeader) + count*sizeof(AssetPackEntry);
+	for (int i=0; i<count; i++) {
+		const char* name = argv[i+2];
+		if (strlen(name) >= ASSET_PACK_NAME_LENGTH) {
+			cerr << "Asset name too long: " << name << endl;
+			return 1;
+		}
+		ifstream file(name, ios::in | ios::binary);
+		if (!file.is_open()) {
+			cerr << "Cannot open asset: " << name << endl;
+			return 1;
+		}
+		blobs[i].assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+
+		offset = (offset + ASSET_PACK_ALIGN-1) / ASSET_PACK_ALIGN * ASSET_PACK_ALIGN;
+		memset(&entries[i], 0, sizeof(AssetPackEntry));
+		strcpy(entries[i].name, name);
+		entries[i].offset = offset;
+		entries[i].size = blobs[i].size();
+		offset += blobs[i].size();
+	}
+
+	ofstream pack(argv[1], ios::out | ios::binary | ios::trunc);
+	if (!pack.is_open()) {
+		cerr << "Cannot write pack: " << argv[1] << endl;
+		return 1;
+	}
+	AssetPackHeader header = { ASSET_PACK_MAGIC, ASSET_PACK_VERSION, (uint32_t)count, 0 };
+	pack.write((const char*)&header, sizeof(header));
+	pack.write((const char*)&entries[0], count*sizeof(AssetPackEntry));
+
+	uint64_t written = sizeof(AssetPackHeader) + count*sizeof(AssetPackEntry);
+	for (int i=0; i<count; i++) {
+		// Pad up to the aligned start of this blob
+		while (written < entries[i].offset) {
+			pack.put(0);
+			written++;
+		}
+		if (!blobs[i].empty())
+			pack.write(&blobs[i][0], blobs[i].size());
+		written += blobs[i].size();
+		cout << entries[i].name << ": " << entries[i].size << " bytes at " << entries[i].offset << endl;
+	}
+	if (!pack.good()) {
+		cerr << "Error writing pack: " << argv[1] << endl;
+		return 1;
+	}
+	cout << argv[1] << ": " << count << " assets, " << written << " bytes" << endl;
+	return 0;
+}
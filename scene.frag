@@ -0,0 +1,22 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec3 fragColor;
+in vec2 fragTexCoord;
+flat in float fragLayer;
+
+// output data
+out vec3 color;
+
+// Every material, one layer each
+uniform sampler2DArray texSampler;
+
+void main()
+{
+    // Vertex colored meshes have no layer, textured ones sample theirs.
+    // The layer is the same for the whole mesh, so neighbouring fragments never diverge
+    if (fragLayer < 0)
+        color = fragColor;
+    else
+        color = texture( texSampler, vec3(fragTexCoord, fragLayer) ).rgb;
+}
@@ -0,0 +1,41 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+layout (location = 2) in vec3 vertexTexCoord; // s, t, material layer - a negative layer takes the vertex color
+
+// per-frame data : written once per frame, shared by all programs
+layout (std140) uniform FrameData
+{
+    mat4 view;
+    mat4 projection;
+    mat4 VP;
+    mat4 hudVP;
+    vec4 time;
+};
+
+// per-instance data : xyz = translation, w = rotation about +Y (radians)
+layout (location = 3) in vec4 instanceOffset;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+out vec2 fragTexCoord;
+flat out float fragLayer;
+
+void main ()
+{
+    // Model transform = translate(instanceOffset.xyz) * rotateY(instanceOffset.w)
+    float c = cos(instanceOffset.w);
+    float s = sin(instanceOffset.w);
+    vec3 p = vec3(c*vertexPosition.x + s*vertexPosition.z, vertexPosition.y, c*vertexPosition.z - s*vertexPosition.x);
+    vec4 v = vec4(p + instanceOffset.xyz, 1); // Transform an homogeneous 4D vector
+
+    // Both are interpolated, the material decides which one the fragment uses
+    fragColor = vertexColor;
+    fragTexCoord = vertexTexCoord.st;
+    fragLayer = vertexTexCoord.p;
+
+    // Output position of the vertex, in clip space : VP * model * position
+    gl_Position = VP * v;
+}
@@ -0,0 +1,20 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec2 fragTexCoord;
+in vec3 fragColor;
+
+// output data
+out vec4 color;
+
+// Glyph coverage, one channel
+uniform sampler2D atlas;
+
+void main()
+{
+    // Output color = string color, with the glyph coverage as alpha
+    float coverage = texture(atlas, fragTexCoord).r;
+    if (coverage < 0.02)
+        discard;
+    color = vec4(fragColor, coverage);
+}
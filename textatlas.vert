@@ -0,0 +1,25 @@
+#version 330 core
+
+// per-frame data : written once per frame, shared by all programs
+layout (std140) uniform FrameData
+{
+    mat4 view;
+    mat4 projection;
+    mat4 VP;
+    mat4 hudVP;
+    vec4 time;
+};
+
+// per-vertex data : xy = position on the HUD plane, zw = atlas coordinates
+layout (location = 0) in vec4 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+
+out vec2 fragTexCoord;
+out vec3 fragColor;
+
+void main ()
+{
+    gl_Position = hudVP * vec4(vertexPosition.xy, 0.0, 1.0);
+    fragTexCoord = vertexPosition.zw;
+    fragColor = vertexColor;
+}